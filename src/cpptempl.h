@@ -14,32 +14,85 @@
 #ifndef CPPTEMPL_H_
 #define CPPTEMPL_H_
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <algorithm>
 #include <memory>
+#include <memory_resource>
+#include <new>
+#include <tuple>
+#include <stdexcept>
+#include <ostream>
+#include <functional>
+#include <atomic>
+#include <utility>
+#include <type_traits>
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <condition_variable>
+#include <exception>
+#include <errno.h>
+#include <sys/stat.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
+#endif
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CPPTEMPL_X86_SIMD 1
+#endif
+// ct_template needs string literals as template arguments (C++20)
+#if defined(__cpp_nontype_template_args) && \
+    __cpp_nontype_template_args >= 201911L
+#define CPPTEMPL_CT_TEMPLATE 1
+#endif
 
 namespace cpptempl {
 
 
-inline void SplitString(const std::string& str,
+// splits on any char of delim, empty fields are skipped like strtok,
+// but without its global state so it is safe from any thread
+inline void SplitString(std::string_view str,
                         const char* delim,
                         std::vector<std::string>* result) {
-  char *cstr, *p;
-  cstr = new char[str.size()+1];
-  snprintf(cstr, str.size()+1, "%s", str.c_str());
-  p = strtok(cstr, delim);  // NOLINT'
-  while (p != NULL) {
-    result->push_back(std::string(p));
-    p = strtok(NULL, delim);  // NOLINT'
-  }
-  delete[] cstr;
+  size_t pos = str.find_first_not_of(delim);
+  while (pos != std::string_view::npos) {
+    size_t end = str.find_first_of(delim, pos);
+    result->emplace_back(str.substr(pos, end - pos));
+    pos = str.find_first_not_of(delim, end);
+  }
 }
 
+// thrown when template text has syntax error, such as unbalanced
+// {% endfor %}/{% endif %} or a malformed for statement
+class TemplateException : public std::runtime_error {
+ public:
+  explicit TemplateException(const std::string& what)
+      : std::runtime_error("cpptempl: " + what) {}
+};
+
+// auto_data is 16 bytes: an 8 bytes payload, 6 more bytes for inline
+// strings, the inline string size and the type. Strings up to 14 bytes
+// are stored inline, longer strings, maps and lists live behind one
+// pointer, so scalars never allocate.
+// Long strings, maps and lists are allocated from the memory resource
+// current on the thread when they are created (see ArenaScope), and
+// remember it, so they are always freed to the right resource.
 class auto_data {
  public:
   ///////////////////////////
@@ -52,107 +105,140 @@ class auto_data {
       number_integer,
       number_float,
       map,
-      list
+      list,
+      lazy
         };
 
+  // std::less<> allows lookup by string_view without building a string
+  using map_type = std::pmr::map<std::pmr::string, auto_data, std::less<>>;
+  using list_type = std::pmr::vector<auto_data>;
+
+  // long string, the chars follow the header in the same allocation
+  struct long_string {
+    std::pmr::memory_resource* resource;
+    size_t size;
+    char* data() {
+      return reinterpret_cast<char*>(this + 1);
+    }
+  };
+
+ public:
+  // computes a lazy value, see auto_data::lazy
+  using provider = std::function<auto_data()>;
+
+ private:
+  struct lazy_value {
+    std::pmr::memory_resource* resource;
+    provider fn;
+  };
+
   ///////////////////////////
   // value storage //
   ///////////////////////////
   union data_value {
-    std::string* str;
+    long_string* str;
     bool boolean;
     int64_t int_val;
     double f_val;
-
-    data_value() {
-    }
-    data_value(std::string* v) {
-      str = v;
-    }
-    data_value(bool boolean) : boolean(boolean) {}
-    data_value(int64_t v) : int_val(v) {}
-    data_value(double v) : f_val(v) {}
-    data_value(data_type t) {
-      switch (t) {
-        case data_type::string: {
-          str = NULL;
-          break;
-        }
-        case data_type::boolean: {
-          boolean = false;
-          break;
-        }
-        case data_type::number_integer: {
-          int_val = 0;
-          break;
-        }
-        case data_type::number_float: {
-          f_val = 0.0;
-        }
-        default:
-          break;
-      }
-    }
+    map_type* map;
+    list_type* list;
+    lazy_value* lazy;
   };
 
  public:
   // 从其它类型构造basic_data
   using string_t = std::string;
   auto_data() {
-    type = data_type::null;
+    set_null();
+  }
+  auto_data(const string_t& v) {  // NOLINT
+    set_string(v.data(), v.size());
+  }
+  auto_data(const char* v) {  // NOLINT
+    set_string(v, strlen(v));
+  }
+
+  auto_data(bool v) {  // NOLINT
+    set_null();
+    type = data_type::boolean;
+    value.boolean = v;
+  }
+  auto_data(int64_t v) {  // NOLINT
+    set_null();
+    type = data_type::number_integer;
+    value.int_val = v;
+  }
+  auto_data(int v) : auto_data(static_cast<int64_t>(v)) {}  // NOLINT
+  auto_data(size_t v) : auto_data(static_cast<int64_t>(v)) {}  // NOLINT
+  auto_data(double v) {  // NOLINT
+    set_null();
+    type = data_type::number_float;
+    value.f_val = v;
   }
-  auto_data(const string_t& v)  // NOLINT
-      : type(data_type::string) {
-    std::string* str = new std::string(v);
-    value.str = str;
-  }
-  auto_data(const char* v)  // NOLINT
-      : type(data_type::string) {
-    std::string* str = new std::string(v);
-    value.str = str;
-  }
-
-  auto_data(bool v)  // NOLINT
-      : type(data_type::boolean), value(v) {}
-  auto_data(int64_t v)  // NOLINT
-      : type(data_type::number_integer), value(v) {}
-  auto_data(int v)  // NOLINT
-      : type(data_type::number_integer), value((int64_t)v) {}
-  auto_data(size_t v)  // NOLINT
-      : type(data_type::number_integer), value((int64_t)v) {}
-  auto_data(double v)  // NOLINT
-      : type(data_type::number_float), value(v) {}
   auto_data(const auto_data& data) {
-    type = data.type;
-    if (data.type == data_type::string) {
-      value.str = new std::string(*(data.value.str));
-    } else if (data.type == data_type::map) {
-      for (auto& item : data.map_data) {
-        auto_data d = item.second;
-        map_data[item.first] = d;
+    switch (data.type) {
+      case data_type::string: {
+        std::string_view v = data.str();
+        set_string(v.data(), v.size());
+        break;
       }
-    } else {
-      value = data.value;
+      case data_type::map: {
+        set_null();
+        value.map = create<map_type>(*data.value.map);
+        type = data_type::map;
+        break;
+      }
+      case data_type::list: {
+        set_null();
+        value.list = create<list_type>(*data.value.list);
+        type = data_type::list;
+        break;
+      }
+      case data_type::lazy: {
+        set_lazy(data.value.lazy->fn);
+        break;
+      }
+      default: {
+        value = data.value;
+        small_size = 0;
+        type = data.type;
+        break;
+      }
+    }
+  }
+
+  // a value computed by fn only when a render reaches it, e.g. behind an
+  // {% if %} that is false it is never called. Rendering through a
+  // Context calls fn at most once per render and keeps the result for
+  // the rest of it; other reads call fn each time.
+  static auto_data lazy(provider fn) {
+    auto_data data;
+    data.set_lazy(std::move(fn));
+    return data;
+  }
+
+  // result of the provider of a lazy value, a copy of anything else
+  auto_data evaluate() const {
+    if (type == data_type::lazy) {
+      return value.lazy->fn();
     }
+    return *this;
+  }
+
+  // moving only copies the 16 bytes, data becomes null
+  auto_data(auto_data&& data) noexcept {
+    set_null();
+    swap(data);
   }
 
 
   ~auto_data() {
-    if (type == data_type::string && value.str != NULL) {
-      delete value.str;
-      value.str = NULL;
-    }
+    reset();
   }
 
   // map
-  bool has(std::string key) const {
-    if (type == data_type::map) {
-      auto iter = map_data.find(key);
-      if (iter != map_data.end()) {
-        return true;
-      }
-    }
-    return false;
+  bool has(std::string_view key) const {
+    return find(key) != NULL;
   }
   // because of [] will insert data for key when not found, so
   // can't defined as auto_data& operator[](const std::stirng& key) const;
@@ -160,52 +246,74 @@ class auto_data {
   // besides can't return const auto_data&, bacause of it will be use
   // data["test"] = "test", this will change the result of reference
   auto_data& operator[](const std::string& key) {
-    auto iter = map_data.find(key);
-    if (iter == map_data.end()) {  // find
-      map_data[key] = auto_data();
-    }
-    type = data_type::map;
-    return map_data[key];
+    return emplace(key);
   }
   auto_data& operator[](const char* key) {
-    auto iter = map_data.find(key);
-    if (iter == map_data.end()) {  // find
-      map_data[key] = auto_data();
+    return emplace(key);
+  }
+
+  // NULL when not a map or there is no data for key
+  const auto_data* find(std::string_view key) const {
+    if (type == data_type::map) {
+      auto iter = value.map->find(key);
+      if (iter != value.map->end()) {
+        return &iter->second;
+      }
     }
-    type = data_type::map;
-    return map_data[key];
+    return NULL;
   }
 
-  // because of want return auto_data&, so when there is not data
-  // for key, can't new one, here throw out_of_range exception
-  const auto_data& Get(const std::string& key) const {
-    auto iter = map_data.find(key);
-    if (iter == map_data.end()) {  // find
+  const auto_data& Get(std::string_view key) const {
+    const auto_data* item = find(key);
+    if (item == NULL) {  // find
       throw new std::out_of_range("out of range is Get method");;
     }
-    return map_data.at(key);
+    return *item;
   }
-  
+
 
   // vector
   int size() const {
-    return list_data.size();
+    if (type != data_type::list) {
+      return 0;
+    }
+    return value.list->size();
   }
-  auto_data operator[](int index) const {
-    return list_data[index];
+  const auto_data& operator[](int index) const {
+    return (*value.list)[index];
   }
   void push_back(const auto_data& data) {
-    type = data_type::list;
-    list_data.push_back(data);
+    mutable_list().push_back(data);
+  }
+  void push_back(auto_data&& data) {
+    mutable_list().push_back(std::move(data));
+  }
+  // construct the element in place from args
+  template <class... Args>
+  auto_data& emplace_back(Args&&... args) {
+    return mutable_list().emplace_back(std::forward<Args>(args)...);
+  }
+  // insert into map when key isn't there yet, returns the value for key
+  template <class... Args>
+  auto_data& emplace(std::string_view key, Args&&... args) {
+    map_type& map = mutable_map();
+    auto iter = map.find(key);
+    if (iter == map.end()) {
+      iter = map.emplace(std::piecewise_construct,
+                         std::forward_as_tuple(key),
+                         std::forward_as_tuple(
+                             std::forward<Args>(args)...)).first;
+    }
+    return iter->second;
   }
 
-  bool operator ==(const auto_data& data) {
+  bool operator ==(const auto_data& data) const {
     if (this->type != data.type) {
       return false;
     }
     switch (type) {
       case data_type::string: {
-        return *(this->value.str) == *(data.value.str);
+        return str() == data.str();
       }
       case data_type::boolean: {
         return value.boolean == data.value.boolean;
@@ -219,6 +327,9 @@ class auto_data {
       case data_type::map: {
         return false;
       }
+      case data_type::lazy: {
+        return value.lazy == data.value.lazy;
+      }
       default:
         return false;
     }
@@ -226,27 +337,32 @@ class auto_data {
   }
 
   // assignment operator
-  void operator =(const auto_data& data) {
-    type = data.type;
-    if (data.type == data_type::string) {
-      value.str = new std::string(data.value.str->c_str());
-    } else if (data.type == data_type::map) {
-      map_data = data.map_data;
-    } else {
-      value = data.value;
+  auto_data& operator =(const auto_data& data) {
+    if (this != &data) {
+      auto_data tmp(data);
+      swap(tmp);
     }
+    return *this;
   }
-  operator std::string() const {
-    std::string str = "";
-    switch (type) {
-      case data_type::string: {
-        str = std::string((*(value.str)));
-        break;
-      }
-      default:
-        break;
+  auto_data& operator =(auto_data&& data) noexcept {
+    if (this != &data) {
+      reset();
+      swap(data);
     }
-    return str;
+    return *this;
+  }
+  // string value without copy, empty when it's not a string
+  std::string_view str() const {
+    if (type != data_type::string) {
+      return std::string_view();
+    }
+    if (small_size == kLongString) {
+      return std::string_view(value.str->data(), value.str->size);
+    }
+    return std::string_view(small_data(), small_size);
+  }
+  operator std::string() const {
+    return std::string(str());
   }
   operator int() const {
     int64_t v = 0;
@@ -317,15 +433,15 @@ class auto_data {
     }
   }
 
-  data_type Type() {
+  data_type Type() const {
     return type;
   }
 
-  bool empty() {
+  bool empty() const {
     return type == data_type::null;
   }
 
-  bool is_true() {
+  bool is_true() const {
     switch (type) {
       case data_type::null: {
         return false;
@@ -339,6 +455,9 @@ class auto_data {
       case data_type::number_float: {
         return value.f_val != 0;
       }
+      case data_type::lazy: {
+        return evaluate().is_true();
+      }
       default:
         return true;
         break;
@@ -346,292 +465,2106 @@ class auto_data {
     return true;
   }
 
+  // resource long strings, maps and lists created on this thread are
+  // allocated from, std::pmr::get_default_resource() unless changed
+  static std::pmr::memory_resource* resource() {
+    std::pmr::memory_resource* r = current_resource();
+    return r != NULL ? r : std::pmr::get_default_resource();
+  }
+  // returns the previous resource, NULL restores the default
+  static std::pmr::memory_resource* set_resource(
+      std::pmr::memory_resource* r) {
+    std::pmr::memory_resource* prev = current_resource();
+    current_resource() = r;
+    return prev;
+  }
+
+  // shared null value, returned by lookups that find nothing
+  static const auto_data& null_value() {
+    static const auto_data null_data;
+    return null_data;
+  }
+
  private:
-  data_type type;
-  data_value value = data_type::null;
-  std::map<std::string, auto_data> map_data;
-  std::vector<auto_data> list_data;
-};
+  static const size_t kSmallSize = 14;
+  static const uint8_t kLongString = 0xff;
+
+  // inline string bytes start at value and run into small_tail
+  char* small_data() {
+    static_assert(offsetof(auto_data, small_tail) == sizeof(data_value),
+                  "small_tail should follow value");
+    return reinterpret_cast<char*>(this);
+  }
+  const char* small_data() const {
+    return reinterpret_cast<const char*>(this);
+  }
 
+  void set_null() {
+    value.int_val = 0;
+    small_size = 0;
+    type = data_type::null;
+  }
 
-//////////////////////////////////////////////////////////////////////////
-// parse_val
-//////////////////////////////////////////////////////////////////////////
-// will call auto_data copy constructor
-inline auto_data parse_val(std::string key, const auto_data& data) {
-  // quoted string
-  if (key[0] == '\"') {
-    size_t index = key.substr(1).find_last_of("\"");
-    if (index != std::string::npos) {
-      return key.substr(1, index);
+  static std::pmr::memory_resource*& current_resource() {
+    static thread_local std::pmr::memory_resource* r = NULL;
+    return r;
+  }
+
+  // map or list allocated from the current resource, and using it
+  template <class T, class... Args>
+  static T* create(Args&&... args) {
+    std::pmr::memory_resource* r = resource();
+    void* p = r->allocate(sizeof(T), alignof(T));
+    return new (p) T(std::forward<Args>(args)...,
+                     typename T::allocator_type(r));
+  }
+
+  template <class T>
+  static void destroy(T* p) {
+    std::pmr::memory_resource* r = p->get_allocator().resource();
+    p->~T();
+    r->deallocate(p, sizeof(T), alignof(T));
+  }
+
+  void set_string(const char* v, size_t size) {
+    set_null();
+    if (size <= kSmallSize) {
+      memcpy(small_data(), v, size);
+      small_size = static_cast<uint8_t>(size);
+    } else {
+      std::pmr::memory_resource* r = resource();
+      void* p = r->allocate(sizeof(long_string) + size,
+                            alignof(long_string));
+      value.str = new (p) long_string{r, size};
+      memcpy(value.str->data(), v, size);
+      small_size = kLongString;
     }
-    return "";
+    type = data_type::string;
   }
-  size_t index = key.find(".");
-  if (index == std::string::npos) {
-    if (!data.has(key)) {
-      return auto_data();
+
+  // free what this value owns and become null
+  void reset() {
+    switch (type) {
+      case data_type::string: {
+        if (small_size == kLongString) {
+          value.str->resource->deallocate(
+              value.str, sizeof(long_string) + value.str->size,
+              alignof(long_string));
+        }
+        break;
+      }
+      case data_type::map: {
+        destroy(value.map);
+        break;
+      }
+      case data_type::list: {
+        destroy(value.list);
+        break;
+      }
+      case data_type::lazy: {
+        std::pmr::memory_resource* r = value.lazy->resource;
+        value.lazy->~lazy_value();
+        r->deallocate(value.lazy, sizeof(lazy_value), alignof(lazy_value));
+        break;
+      }
+      default:
+        break;
     }
-    return data.Get(key);
+    set_null();
   }
 
-  std::string sub_key = key.substr(0, index);
-  if (!data.has(sub_key)) {
-    return auto_data();
+  void set_lazy(provider fn) {
+    std::pmr::memory_resource* r = resource();
+    void* p = r->allocate(sizeof(lazy_value), alignof(lazy_value));
+    value.lazy = new (p) lazy_value{r, std::move(fn)};
+    small_size = 0;
+    type = data_type::lazy;
   }
-  const auto_data& item = data.Get(sub_key);
-  return parse_val(key.substr(index+1), item);
-}
 
+  void swap(auto_data& data) noexcept {
+    std::swap(value, data.value);
+    std::swap(small_tail, data.small_tail);
+    std::swap(small_size, data.small_size);
+    std::swap(type, data.type);
+  }
 
+  map_type& mutable_map() {
+    if (type != data_type::map) {
+      reset();
+      value.map = create<map_type>();
+      type = data_type::map;
+    }
+    return *value.map;
+  }
 
-// token classes
-typedef enum  {
-  TOKEN_TYPE_NONE,
-  TOKEN_TYPE_TEXT,
-  TOKEN_TYPE_VAR,
-  TOKEN_TYPE_IF,
-  TOKEN_TYPE_FOR,
-  TOKEN_TYPE_ENDIF,
-  TOKEN_TYPE_ENDFOR,
-} TokenType;
+  list_type& mutable_list() {
+    if (type != data_type::list) {
+      reset();
+      value.list = create<list_type>();
+      type = data_type::list;
+    }
+    return *value.list;
+  }
 
+  data_value value;
+  char small_tail[kSmallSize - sizeof(data_value)];
+  uint8_t small_size;  // inline string size, or kLongString
+  data_type type;
+};
 
+static_assert(sizeof(auto_data) == 16, "auto_data should be 16 bytes");
+static_assert(std::is_nothrow_move_constructible<auto_data>::value,
+              "vector<auto_data> should move elements when it grows");
 
-class Token;
-using token_vector = std::vector<std::shared_ptr<Token>>;
-// Template tokens
-// base class for all token types
-class Token {
+// while alive, long strings, maps and lists of auto_data created on this
+// thread are allocated from resource, e.g. a monotonic_buffer_resource
+// per request, so building a data model doesn't touch the global heap.
+// Values built inside must not outlive the resource.
+class ArenaScope {
  public:
-  virtual TokenType gettype() = 0;
-  virtual void set_children(const token_vector&) {
-    printf("this token can't set child\n");
+  explicit ArenaScope(std::pmr::memory_resource* resource)
+      : m_prev(auto_data::set_resource(resource)) {}
+  ~ArenaScope() {
+    auto_data::set_resource(m_prev);
   }
-  virtual std::string get_text(const auto_data&) { return ""; }
+  ArenaScope(const ArenaScope&) = delete;
+  ArenaScope& operator=(const ArenaScope&) = delete;
+
+ private:
+  std::pmr::memory_resource* m_prev;
 };
 
 
+//////////////////////////////////////////////////////////////////////////
+// struct binding
+// C++ structs rendered in place, without building auto_data. A struct
+// lists its fields by specializing type_fields:
+//   template <>
+//   struct cpptempl::type_fields<Person> {
+//     static std::vector<cpptempl::FieldInfo> get() {
+//       return {cpptempl::field("name", &Person::name),
+//               cpptempl::field("friends", &Person::friends)};
+//     }
+//   };
+// Fields may be bools, numbers, strings, auto_data, std::vector of any
+// of these, or other registered structs.
+//////////////////////////////////////////////////////////////////////////
+struct TypeInfo;
+
+// a member of a registered struct, name must be a literal
+struct FieldInfo {
+  std::string_view name;
+  // address of the member in obj
+  const void* (*get)(const void* obj, const FieldInfo& field);
+  // type of the member, NULL for auto_data; resolved on use, so a
+  // struct can hold a vector of itself
+  const TypeInfo* (*type)();
+  // the member pointer, read back by get
+  unsigned char member[2 * sizeof(void*)];
+};
 
+struct TypeInfo {
+  enum Kind : uint8_t {
+    SCALAR,  // bool or number
+    STRING,
+    LIST,    // std::vector
+    OBJECT,  // registered struct
+  };
+  Kind kind;
+  // same rules as auto_data: strings, lists and structs are true,
+  // a NULL const char* is false like null
+  bool (*is_true)(const void* obj) = NULL;
+  auto_data (*scalar)(const void* obj) = NULL;
+  std::string_view (*str)(const void* obj) = NULL;
+  size_t (*size)(const void* obj) = NULL;
+  const void* (*at)(const void* obj, size_t index) = NULL;
+  const TypeInfo* (*element)() = NULL;
+  std::vector<FieldInfo> fields;
 
-// normal text
-class TokenText : public Token {
- private:
-  std::string m_text;
- public:
-  explicit TokenText(std::string text) : m_text(text) {}
-  TokenType gettype() { return TOKEN_TYPE_TEXT;}
-  std::string get_text(const auto_data&) {
-    return m_text;
+  const FieldInfo* find(std::string_view name) const {
+    for (const FieldInfo& field : fields) {
+      if (field.name == name) {
+        return &field;
+      }
+    }
+    return NULL;
+  }
+  bool owns(const FieldInfo* field) const {
+    return field >= fields.data() && field < fields.data() + fields.size();
   }
 };
 
-// variable
-class TokenVar : public Token {
- private:
-  std::string m_key;
+template <class T>
+struct type_fields;
+
+template <class T>
+struct is_vector : std::false_type {};
+template <class T, class A>
+struct is_vector<std::vector<T, A>> : std::true_type {};
+
+template <class T>
+TypeInfo make_type_info();
+
+// NULL for auto_data, which is rendered as it is
+template <class T>
+const TypeInfo* type_of() {
+  if constexpr (std::is_same<T, auto_data>::value) {
+    return NULL;
+  } else {
+    static const TypeInfo info = make_type_info<T>();
+    return &info;
+  }
+}
+
+template <class T>
+TypeInfo make_type_info() {
+  TypeInfo info;
+  info.is_true = [](const void*) { return true; };
+  if constexpr (std::is_same<T, bool>::value) {
+    info.kind = TypeInfo::SCALAR;
+    info.scalar = [](const void* obj) {
+      return auto_data(*static_cast<const bool*>(obj));
+    };
+    info.is_true = [](const void* obj) {
+      return *static_cast<const bool*>(obj);
+    };
+  } else if constexpr (std::is_integral<T>::value) {
+    info.kind = TypeInfo::SCALAR;
+    info.scalar = [](const void* obj) {
+      return auto_data(static_cast<int64_t>(*static_cast<const T*>(obj)));
+    };
+    info.is_true = [](const void* obj) {
+      return *static_cast<const T*>(obj) != 0;
+    };
+  } else if constexpr (std::is_floating_point<T>::value) {
+    info.kind = TypeInfo::SCALAR;
+    info.scalar = [](const void* obj) {
+      return auto_data(static_cast<double>(*static_cast<const T*>(obj)));
+    };
+    info.is_true = [](const void* obj) {
+      return *static_cast<const T*>(obj) != 0;
+    };
+  } else if constexpr (std::is_same<T, const char*>::value) {
+    info.kind = TypeInfo::STRING;
+    info.str = [](const void* obj) {
+      const char* str = *static_cast<const char* const*>(obj);
+      return str != NULL ? std::string_view(str) : std::string_view();
+    };
+    info.is_true = [](const void* obj) {
+      return *static_cast<const char* const*>(obj) != NULL;
+    };
+  } else if constexpr (std::is_convertible<const T&,
+                                           std::string_view>::value) {
+    info.kind = TypeInfo::STRING;
+    info.str = [](const void* obj) {
+      return std::string_view(*static_cast<const T*>(obj));
+    };
+  } else if constexpr (is_vector<T>::value) {
+    info.kind = TypeInfo::LIST;
+    info.size = [](const void* obj) {
+      return static_cast<const T*>(obj)->size();
+    };
+    info.at = [](const void* obj, size_t index) -> const void* {
+      return &(*static_cast<const T*>(obj))[index];
+    };
+    info.element = &type_of<typename T::value_type>;
+  } else {
+    info.kind = TypeInfo::OBJECT;
+    info.fields = type_fields<T>::get();
+  }
+  return info;
+}
+
+template <class T, class M>
+FieldInfo field(std::string_view name, M T::* member) {
+  static_assert(sizeof(member) <= sizeof(FieldInfo::member),
+                "member pointer too large");
+  FieldInfo info;
+  info.name = name;
+  info.get = [](const void* obj, const FieldInfo& field) -> const void* {
+    M T::* member;
+    memcpy(&member, field.member, sizeof(member));
+    return &(static_cast<const T*>(obj)->*member);
+  };
+  info.type = &type_of<M>;
+  memcpy(info.member, &member, sizeof(member));
+  return info;
+}
 
+// remembers the field a path segment resolved to, so a struct field is
+// found by name once per type instead of on every render
+class FieldCache {
  public:
-  explicit TokenVar(std::string key) : m_key(key) {}
-  TokenType gettype() { return TOKEN_TYPE_VAR;}
-  std::string get_text(const auto_data& data) {
-    auto_data ret = parse_val(m_key, data);
-    std::string str = "";
-    switch (ret.Type()) {
-      case auto_data::data_type::string: {
-        return ret;
-      }
-      case auto_data::data_type::boolean: {
-        bool b = ret;
-        str = b ? "true":"false";
-        break;
-      }
-      case auto_data::data_type::number_integer: {
-        char temp[10] = {'\0'};
-        int64_t t = ret;
-        snprintf(temp, sizeof(temp), "%" PRIu64,  t);
-        str = std::string(temp);
-        break;
-      }
-      case auto_data::data_type::number_float: {
-        char temp[10] = {'\0'};
-        double t = ret;
-        snprintf(temp, sizeof(temp), "%f",  t);
-        str = std::string(temp);
-        break;
-      }
-      case auto_data::data_type::null: {
-        str = "";
-        break;
+  FieldCache() {}
+  // copies start empty
+  FieldCache(const FieldCache&) {}
+  FieldCache& operator=(const FieldCache&) {
+    m_field.store(NULL, std::memory_order_relaxed);
+    return *this;
+  }
+
+  const FieldInfo* find(const TypeInfo* type, std::string_view name) const {
+    const FieldInfo* field = m_field.load(std::memory_order_acquire);
+    if (field == NULL || !type->owns(field)) {
+      field = type->find(name);
+      if (field != NULL) {
+        m_field.store(field, std::memory_order_release);
       }
-      default:
-        break;
     }
-    return str;
+    return field;
   }
+
+ private:
+  mutable std::atomic<const FieldInfo*> m_field{NULL};
 };
 
-// for block
-class TokenFor : public Token {
+// a value being rendered: an auto_data, or a struct, vector or field
+// bound with value_ref::of, never owns what it points to
+class value_ref {
  public:
-  std::string m_key;
-  std::string m_val;
-  token_vector m_children;
-  // 拆分出来
-  explicit TokenFor(std::string expr) {
-    std::vector<std::string> elements;
-    char split[] = " ";
-    SplitString(expr, split, &elements);
-    if (elements.size() != 4) {
-      perror("cpp template string have error syntax 'for'");
-      exit(0);
+  value_ref() : m_ptr(&auto_data::null_value()), m_type(NULL) {}
+  value_ref(const auto_data& data)  // NOLINT
+      : m_ptr(&data), m_type(NULL) {}
+  value_ref(const void* ptr, const TypeInfo* type)
+      : m_ptr(ptr), m_type(type) {}
+
+  template <class T>
+  static value_ref of(const T& obj) {
+    return value_ref(&obj, type_of<T>());
+  }
+
+  // NULL unless this is an auto_data
+  const auto_data* data() const {
+    return m_type == NULL ? static_cast<const auto_data*>(m_ptr) : NULL;
+  }
+  const void* ptr() const { return m_ptr; }
+  const TypeInfo* type() const { return m_type; }
+
+  bool is_true() const {
+    if (m_type == NULL) {
+      return data()->is_true();
     }
-    m_val = elements[1];
-    m_key = elements[3];
+    return m_type->is_true(m_ptr);
   }
-  TokenType gettype() { return TOKEN_TYPE_FOR;}
-  void set_children(const token_vector &children) {
-    m_children.assign(children.begin(), children.end());
+
+  int size() const {
+    if (m_type == NULL) {
+      return data()->size();
+    }
+    return m_type->kind == TypeInfo::LIST ?
+        static_cast<int>(m_type->size(m_ptr)) : 0;
   }
-  token_vector &get_children() {
-    return m_children;
+
+  // element of a list, which must be < size()
+  value_ref at(int index) const {
+    if (m_type == NULL) {
+      return (*data())[index];
+    }
+    return value_ref(m_type->at(m_ptr, index), m_type->element());
   }
-  std::string get_text(const auto_data& data) {
-    if (!data.has(m_key)) {
-      printf("has no key:%s\n", m_key.c_str());
-      return "";
+
+  // member of a map or struct, null when missing
+  value_ref find(std::string_view key) const {
+    if (m_type == NULL) {
+      const auto_data* item = data()->find(key);
+      return item != NULL ? value_ref(*item) : value_ref();
     }
-    const auto_data& l = data.Get(m_key);
-    int listSize = l.size();
-    std::string str = "";
-    for (int i = 0; i < listSize; i++) {
-      auto_data d;
-      d[m_val] = l[i];;  // this will call operator=, and will create new object
-      for (size_t j = 0; j < m_children.size(); ++j) {
-        str += m_children[j]->get_text(d);
-      }
+    if (m_type->kind != TypeInfo::OBJECT) {
+      return value_ref();
     }
-    return str;
+    return member(m_type->find(key));
   }
-};
 
-// if block
-class TokenIf : public Token {
- public:
-  std::string m_expr;
-  token_vector m_children;
-  explicit TokenIf(std::string expr) : m_expr(expr) {}
-  TokenType gettype() { return TOKEN_TYPE_IF;}
-  void set_children(const token_vector &children) {
-    m_children.assign(children.begin(), children.end());
-  }
-  token_vector &get_children() { return m_children;}
-  std::string get_text(const auto_data& data) {
-    std::string str = "";
-    if (is_true(data)) {
-      for (size_t j = 0; j < m_children.size(); ++j) {
-        str += m_children[j]->get_text(data);
-      }
-    } else {
-      // printf("is not true:%s\n", m_expr.c_str());
+  value_ref find(std::string_view key, const FieldCache& cache) const {
+    if (m_type == NULL || m_type->kind != TypeInfo::OBJECT) {
+      return find(key);
     }
-    return str;
+    return member(cache.find(m_type, key));
   }
-  bool is_true(const auto_data& data) {
-    std::vector<std::string> elements;
-    char split[] = " ";
-    SplitString(m_expr, split, &elements);
-    if (elements.size() == 1) {
-      return false;
-    } else if (elements.size() == 2) {
-      return parse_val(elements[1], data).is_true();
-    } else if (elements.size() == 3) {
-      if (elements[1] == "not") {
-        return !parse_val(elements[2], data).is_true();
-      }
-    } else if (elements.size() == 4) {
-      if (elements[2] == "==") {
-        auto_data lhs = parse_val(elements[1], data);
-        auto_data rhs = parse_val(elements[3], data);
-        return lhs == rhs;
-      }
+
+  // copy of a scalar or string, structs and lists give null
+  auto_data to_data() const {
+    if (m_type == NULL) {
+      return *data();
+    }
+    switch (m_type->kind) {
+      case TypeInfo::SCALAR:
+        return m_type->scalar(m_ptr);
+      case TypeInfo::STRING:
+        if (!m_type->is_true(m_ptr)) {
+          return auto_data();
+        }
+        return auto_data(std::string(m_type->str(m_ptr)));
+      default:
+        return auto_data();
     }
-    return false;
   }
-};
 
-// end of block
-// end of control block
-class TokenEnd : public Token {
  private:
-  std::string m_type;
- public:
-  explicit TokenEnd(std::string text) : m_type(text) {}
-  TokenType gettype() {
-    return m_type == "endfor" ? TOKEN_TYPE_ENDFOR : TOKEN_TYPE_ENDIF;
+  value_ref member(const FieldInfo* field) const {
+    if (field == NULL) {
+      return value_ref();
+    }
+    return value_ref(field->get(m_ptr, *field), field->type());
   }
-};
 
+  const void* m_ptr;
+  const TypeInfo* m_type;
+};
 
 
-class Parser {
- private:
-    //////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+// VarPath
+// a variable reference like a.b.c, split into segments once when the
+// template is compiled, or a quoted string literal
+//////////////////////////////////////////////////////////////////////////
+class VarPath {
+ public:
+  VarPath() {}
+  explicit VarPath(std::string_view key) {
+    // quoted string
+    if (!key.empty() && key[0] == '\"') {
+      m_is_literal = true;
+      size_t index = key.substr(1).find_last_of("\"");
+      if (index != std::string_view::npos) {
+        m_literal = std::string(key.substr(1, index));
+      } else {
+        m_literal = "";
+      }
+      return;
+    }
+    size_t pos = 0;
+    while (true) {
+      size_t index = key.find('.', pos);
+      if (index == std::string_view::npos) {
+        m_segments.push_back(std::string(key.substr(pos)));
+        break;
+      }
+      m_segments.push_back(std::string(key.substr(pos, index-pos)));
+      pos = index+1;
+    }
+    m_fields.resize(m_segments.size());
+  }
+
+  static VarPath from_literal(const auto_data& value) {
+    VarPath path;
+    path.m_is_literal = true;
+    path.m_literal = value;
+    return path;
+  }
+
+  bool is_literal() const { return m_is_literal; }
+  const auto_data& literal() const { return m_literal; }
+  const std::vector<std::string>& segments() const { return m_segments; }
+  // struct field segment i was last resolved to
+  const FieldCache& field_cache(size_t i) const { return m_fields[i]; }
+
+ private:
+  bool m_is_literal = false;
+  auto_data m_literal;
+  std::vector<std::string> m_segments;
+  std::vector<FieldCache> m_fields;
+};
+
+
+//////////////////////////////////////////////////////////////////////////
+// ThreadPool
+// persistent workers for render_batch and parallel loops
+//////////////////////////////////////////////////////////////////////////
+// parallel_for hands out indices in chunks of grain from one shared
+// counter, so a thread that finishes early keeps taking work from the
+// rest. The calling thread works too. A parallel_for issued while the
+// pool is busy, including one nested inside another, runs on the
+// calling thread alone, so it never deadlocks.
+class ThreadPool {
+ public:
+  // threads counts the calling thread, 0 means one per hardware thread
+  explicit ThreadPool(size_t threads = 0) {
+    if (threads == 0) {
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (size_t i = 1; i < threads; ++i) {
+      m_workers.emplace_back([this]() { worker_loop(); });
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_wake.notify_all();
+    for (std::thread& t : m_workers) {
+      t.join();
+    }
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  size_t size() const { return m_workers.size() + 1; }
+
+  // calls fn(i) for every i in [0, count) and waits for all of them,
+  // the first exception thrown by fn is rethrown here
+  void parallel_for(size_t count, size_t grain,
+                    const std::function<void(size_t)>& fn) {
+    if (grain == 0) {
+      grain = 1;
+    }
+    bool idle = false;
+    if (m_workers.empty() || count <= grain ||
+        !m_busy.compare_exchange_strong(idle, true)) {
+      for (size_t i = 0; i < count; ++i) {
+        fn(i);
+      }
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_fn = &fn;
+      m_count = count;
+      m_grain = grain;
+      m_next.store(0, std::memory_order_relaxed);
+      m_error = NULL;
+      m_active = m_workers.size();
+      m_generation++;
+    }
+    m_wake.notify_all();
+    work();
+    std::exception_ptr error;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_done.wait(lock, [this]() { return m_active == 0; });
+      m_fn = NULL;
+      std::swap(error, m_error);
+    }
+    m_busy.store(false);
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+ private:
+  void work() {
+    while (true) {
+      size_t begin = m_next.fetch_add(m_grain, std::memory_order_relaxed);
+      if (begin >= m_count) {
+        break;
+      }
+      size_t end = std::min(begin + m_grain, m_count);
+      try {
+        for (size_t i = begin; i < end; ++i) {
+          (*m_fn)(i);
+        }
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_error) {
+          m_error = std::current_exception();
+        }
+        m_next.store(m_count, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  void worker_loop() {
+    uint64_t seen = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_wake.wait(lock, [&]() {
+          return m_stop || m_generation != seen;
+        });
+        if (m_stop) {
+          return;
+        }
+        seen = m_generation;
+      }
+      work();
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (--m_active == 0) {
+        m_done.notify_one();
+      }
+    }
+  }
+
+  std::vector<std::thread> m_workers;
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  std::condition_variable m_done;
+  std::atomic<bool> m_busy{false};
+  bool m_stop = false;
+  uint64_t m_generation = 0;
+  size_t m_active = 0;
+  // current job, written under m_mutex before m_generation changes
+  const std::function<void(size_t)>* m_fn = NULL;
+  size_t m_count = 0;
+  size_t m_grain = 1;
+  std::atomic<size_t> m_next{0};
+  std::exception_ptr m_error;
+};
+
+
+// options of a compiled template
+struct RenderOptions {
+  // digits after the decimal point for floats,
+  // -1 writes the shortest text that reads back as the same double
+  int float_precision = -1;
+  // when set, for loops over at least parallel_min_items elements are
+  // split into chunks rendered on the pool, then written in order
+  ThreadPool* pool = NULL;
+  size_t parallel_min_items = 4096;
+};
+
+
+//////////////////////////////////////////////////////////////////////////
+// Context
+// scope chain used while rendering, the root holds the data passed to
+// render, each for loop iteration binds its variable by reference in a
+// scope on the stack, names not bound there resolve in outer scopes
+//////////////////////////////////////////////////////////////////////////
+// results of lazy auto_data computed during one render, each provider
+// is called once even when parallel loops reach it from several threads
+class LazyCache {
+ public:
+  // the lock only guards the map, providers run outside it so chunks
+  // of a parallel loop wait only on a value another chunk is computing
+  const auto_data& get(const auto_data& lazy) {
+    Entry* entry;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      std::unique_ptr<Entry>& slot = m_values[&lazy];
+      if (!slot) {
+        slot = std::make_unique<Entry>();
+      }
+      entry = slot.get();
+    }
+    std::call_once(entry->once, [&] { entry->value = lazy.evaluate(); });
+    return entry->value;
+  }
+
+ private:
+  struct Entry {
+    std::once_flag once;
+    auto_data value;
+  };
+
+  std::mutex m_mutex;
+  std::unordered_map<const auto_data*, std::unique_ptr<Entry>> m_values;
+};
+
+class Context {
+ public:
+  Context() : m_parent(NULL), m_options(&default_options()) {}
+  Context(const auto_data& data)  // NOLINT
+      : m_parent(NULL), m_value(data), m_options(&default_options()) {}
+  Context(const value_ref& root, const RenderOptions* options)
+      : m_parent(NULL), m_value(root), m_options(options) {}
+  Context(const Context* parent, std::string_view name,
+          const value_ref& value)
+      : m_parent(parent), m_name(name), m_value(value),
+        m_options(parent->m_options) {}
+
+  // the lazy results of a root context are not copied
+  Context(const Context& ctx)
+      : m_parent(ctx.m_parent), m_name(ctx.m_name), m_value(ctx.m_value),
+        m_options(ctx.m_options) {}
+  Context& operator=(const Context& ctx) {
+    if (this != &ctx) {
+      release_lazy();
+      m_parent = ctx.m_parent;
+      m_name = ctx.m_name;
+      m_value = ctx.m_value;
+      m_options = ctx.m_options;
+    }
+    return *this;
+  }
+  ~Context() {
+    release_lazy();
+  }
+
+  const Context* parent() const { return m_parent; }
+  const RenderOptions& options() const { return *m_options; }
+  // binds the scope's name to the next element of a loop
+  void rebind(const value_ref& value) { m_value = value; }
+
+  // innermost scope binding name, else the root's member name,
+  // null when neither has it
+  value_ref find(std::string_view name,
+                 const FieldCache& cache = FieldCache()) const {
+    const Context* scope = this;
+    while (scope->m_parent != NULL) {
+      if (scope->m_name == name) {
+        return scope->m_value;
+      }
+      scope = scope->m_parent;
+    }
+    return scope->m_value.find(name, cache);
+  }
+
+  // the result of a lazy auto_data, computed on first use and kept by
+  // the root context, any other value as it is
+  value_ref resolve(const value_ref& value) const {
+    const auto_data* data = value.data();
+    if (data == NULL || data->Type() != auto_data::data_type::lazy) {
+      return value;
+    }
+    const Context* root = this;
+    while (root->m_parent != NULL) {
+      root = root->m_parent;
+    }
+    return root->lazy_cache()->get(*data);
+  }
+  const auto_data& resolve(const auto_data& data) const {
+    return *resolve(value_ref(data)).data();
+  }
+
+ private:
+  LazyCache* lazy_cache() const {
+    LazyCache* cache = m_lazy.load(std::memory_order_acquire);
+    if (cache == NULL) {
+      LazyCache* created = new LazyCache();
+      if (m_lazy.compare_exchange_strong(cache, created,
+                                         std::memory_order_acq_rel)) {
+        cache = created;
+      } else {
+        delete created;
+      }
+    }
+    return cache;
+  }
+
+  void release_lazy() {
+    if (m_lazy.load(std::memory_order_relaxed) != NULL) {
+      delete m_lazy.exchange(NULL);
+    }
+  }
+
+  static const RenderOptions& default_options() {
+    static const RenderOptions options;
+    return options;
+  }
+
+  const Context* m_parent;
+  std::string_view m_name;
+  value_ref m_value;
+  const RenderOptions* m_options;
+  // created by the first lazy value reached from this root
+  mutable std::atomic<LazyCache*> m_lazy{NULL};
+};
+
+
+//////////////////////////////////////////////////////////////////////////
+// lookup
+// returns a pointer into data (or the literal in path), never copies,
+// missing keys give auto_data::null_value(), so result is never NULL.
+// Lazy values are computed once per root context, a result points into
+// it and is valid as long as the root context is
+//////////////////////////////////////////////////////////////////////////
+inline value_ref lookup_value(const VarPath& path, const Context& ctx) {
+  if (path.is_literal()) {
+    return path.literal();
+  }
+  const std::vector<std::string>& segments = path.segments();
+  value_ref item = ctx.resolve(ctx.find(segments[0], path.field_cache(0)));
+  for (size_t i = 1; i < segments.size(); ++i) {
+    item = ctx.resolve(item.find(segments[i], path.field_cache(i)));
+  }
+  return item;
+}
+
+// auto_data only, struct values give null_value
+inline const auto_data* lookup(const VarPath& path, const Context& ctx) {
+  const auto_data* item = lookup_value(path, ctx).data();
+  return item != NULL ? item : &auto_data::null_value();
+}
+
+// member key of item, null_value when item is not a map or lacks key;
+// used by cpptemplc output and ct_template, lazy values on the way are
+// computed through ctx like in lookup_value
+inline const auto_data* lookup(const Context& ctx, const auto_data* item,
+                               std::string_view key) {
+  item = ctx.resolve(*item).find(key);
+  return item != NULL ? &ctx.resolve(*item) : &auto_data::null_value();
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+// parse_val
+//////////////////////////////////////////////////////////////////////////
+// will call auto_data copy constructor, use lookup to avoid it
+inline auto_data parse_val(const VarPath& path, const auto_data& data) {
+  return *lookup(path, data);
+}
+
+inline auto_data parse_val(std::string_view key, const auto_data& data) {
+  return parse_val(VarPath(key), data);
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+// Expression
+// condition of an if block, parsed once into a tree of nodes:
+//   expr    := and ("or" and)*
+//   and     := not ("and" not)*
+//   not     := "not" not | cmp
+//   cmp     := primary (("=="|"!="|"<"|"<="|">"|">=") primary)?
+//   primary := "(" expr ")" | number | "string" | variable
+//////////////////////////////////////////////////////////////////////////
+class Expression {
+ public:
+  Expression() {}
+  // throws TemplateException when text isn't a valid condition
+  explicit Expression(std::string_view text) {
+    std::vector<std::string_view> words;
+    split_words(text, &words);
+    if (words.empty()) {
+      throw TemplateException("empty condition");
+    }
+    size_t pos = 0;
+    m_root = parse_or(words, &pos);
+    if (pos != words.size()) {
+      throw TemplateException("unexpected '" + std::string(words[pos]) +
+                              "' in condition '" + std::string(text) + "'");
+    }
+  }
+
+  bool is_true(const Context& data) const {
+    if (m_nodes.empty()) {
+      return false;
+    }
+    return eval(m_root, data);
+  }
+
+  // the parsed tree, for code generators like cpptemplc: operands of a
+  // node are indices into nodes(), root() is the whole condition
+  enum Op {
+    OP_VALUE,
+    OP_NOT,
+    OP_AND,
+    OP_OR,
+    OP_EQ,
+    OP_NE,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+  };
+  struct Node {
+    Op op;
+    VarPath path;  // OP_VALUE only
+    size_t lhs;
+    size_t rhs;
+  };
+  const std::vector<Node>& nodes() const { return m_nodes; }
+  size_t root() const { return m_root; }
+
+  // numbers compare by value, strings lexicographically,
+  // other types can only be equal or not
+  static bool compare(Op op, const auto_data& lhs, const auto_data& rhs) {
+    using data_type = auto_data::data_type;
+    data_type lt = lhs.Type();
+    data_type rt = rhs.Type();
+    bool lnum = lt == data_type::number_integer ||
+                lt == data_type::number_float;
+    bool rnum = rt == data_type::number_integer ||
+                rt == data_type::number_float;
+    int order = 0;
+    if (lt == data_type::number_integer && rt == data_type::number_integer) {
+      int64_t a = lhs;
+      int64_t b = rhs;
+      order = a < b ? -1 : (a > b ? 1 : 0);
+    } else if (lnum && rnum) {
+      double a = to_double(lhs);
+      double b = to_double(rhs);
+      order = a < b ? -1 : (a > b ? 1 : 0);
+    } else if (lt == data_type::string && rt == data_type::string) {
+      int c = lhs.str().compare(rhs.str());
+      order = c < 0 ? -1 : (c > 0 ? 1 : 0);
+    } else if (op == OP_EQ) {
+      return lhs == rhs;
+    } else if (op == OP_NE) {
+      return !(lhs == rhs);
+    } else {
+      return false;
+    }
+    switch (op) {
+      case OP_EQ: return order == 0;
+      case OP_NE: return order != 0;
+      case OP_LT: return order < 0;
+      case OP_LE: return order <= 0;
+      case OP_GT: return order > 0;
+      case OP_GE: return order >= 0;
+      default: return false;
+    }
+  }
+
+ private:
+  static bool is_op_char(char c) {
+    return c == '=' || c == '!' || c == '<' || c == '>';
+  }
+
+  // words are variables, literals, operators and parentheses
+  static void split_words(std::string_view text,
+                          std::vector<std::string_view>* words) {
+    size_t pos = 0;
+    while (pos < text.size()) {
+      char c = text[pos];
+      size_t end = pos+1;
+      if (c == ' ') {
+        pos++;
+        continue;
+      } else if (c == '(' || c == ')') {
+      } else if (c == '\"') {
+        end = text.find('\"', pos+1);
+        if (end == std::string_view::npos) {
+          throw TemplateException("unterminated string in condition '" +
+                                  std::string(text) + "'");
+        }
+        end++;
+      } else if (is_op_char(c)) {
+        while (end < text.size() && is_op_char(text[end])) {
+          end++;
+        }
+      } else {
+        while (end < text.size() && text[end] != ' ' && text[end] != '(' &&
+               text[end] != ')' && !is_op_char(text[end])) {
+          end++;
+        }
+      }
+      words->push_back(text.substr(pos, end-pos));
+      pos = end;
+    }
+  }
+
+  size_t add_node(Op op, size_t lhs, size_t rhs) {
+    m_nodes.push_back(Node{op, VarPath(), lhs, rhs});
+    return m_nodes.size()-1;
+  }
+
+  size_t parse_or(const std::vector<std::string_view>& words, size_t* pos) {
+    size_t lhs = parse_and(words, pos);
+    while (*pos < words.size() && words[*pos] == "or") {
+      (*pos)++;
+      size_t rhs = parse_and(words, pos);
+      lhs = add_node(OP_OR, lhs, rhs);
+    }
+    return lhs;
+  }
+
+  size_t parse_and(const std::vector<std::string_view>& words, size_t* pos) {
+    size_t lhs = parse_not(words, pos);
+    while (*pos < words.size() && words[*pos] == "and") {
+      (*pos)++;
+      size_t rhs = parse_not(words, pos);
+      lhs = add_node(OP_AND, lhs, rhs);
+    }
+    return lhs;
+  }
+
+  size_t parse_not(const std::vector<std::string_view>& words, size_t* pos) {
+    if (*pos < words.size() && words[*pos] == "not") {
+      (*pos)++;
+      size_t operand = parse_not(words, pos);
+      return add_node(OP_NOT, operand, 0);
+    }
+    return parse_cmp(words, pos);
+  }
+
+  size_t parse_cmp(const std::vector<std::string_view>& words, size_t* pos) {
+    size_t lhs = parse_primary(words, pos);
+    if (*pos >= words.size() || !is_op_char(words[*pos][0])) {
+      return lhs;
+    }
+    std::string_view word = words[*pos];
+    Op op;
+    if (word == "==") {
+      op = OP_EQ;
+    } else if (word == "!=") {
+      op = OP_NE;
+    } else if (word == "<") {
+      op = OP_LT;
+    } else if (word == "<=") {
+      op = OP_LE;
+    } else if (word == ">") {
+      op = OP_GT;
+    } else if (word == ">=") {
+      op = OP_GE;
+    } else {
+      throw TemplateException("unknown operator '" + std::string(word) + "'");
+    }
+    (*pos)++;
+    size_t rhs = parse_primary(words, pos);
+    return add_node(op, lhs, rhs);
+  }
+
+  size_t parse_primary(const std::vector<std::string_view>& words,
+                       size_t* pos) {
+    if (*pos >= words.size()) {
+      throw TemplateException("incomplete condition");
+    }
+    std::string_view word = words[(*pos)++];
+    if (word == "(") {
+      size_t node = parse_or(words, pos);
+      if (*pos >= words.size() || words[*pos] != ")") {
+        throw TemplateException("missing ')' in condition");
+      }
+      (*pos)++;
+      return node;
+    }
+    if (word == ")" || is_op_char(word[0]) || word == "and" || word == "or") {
+      throw TemplateException("unexpected '" + std::string(word) +
+                              "' in condition");
+    }
+    size_t node = add_node(OP_VALUE, 0, 0);
+    char c = word[0];
+    if ((c >= '0' && c <= '9') ||
+        (c == '-' && word.size() > 1 && word[1] >= '0' && word[1] <= '9')) {
+      // the whole word must be the number, "5abc" is an error
+      const char* end = word.data() + word.size();
+      std::from_chars_result result;
+      if (word.find_first_of(".eE") != std::string_view::npos) {
+        double number = 0;
+        result = std::from_chars(word.data(), end, number);
+        m_nodes[node].path = VarPath::from_literal(number);
+      } else {
+        int64_t number = 0;
+        result = std::from_chars(word.data(), end, number);
+        m_nodes[node].path = VarPath::from_literal(number);
+      }
+      if (result.ec != std::errc() || result.ptr != end) {
+        throw TemplateException("invalid number '" + std::string(word) +
+                                "' in condition");
+      }
+    } else {
+      m_nodes[node].path = VarPath(word);
+    }
+    return node;
+  }
+
+  static double to_double(const auto_data& v) {
+    if (v.Type() == auto_data::data_type::number_integer) {
+      return static_cast<double>(static_cast<int64_t>(v));
+    }
+    return v;
+  }
+
+
+  // struct values are compared through a copy of the scalar
+  static bool compare(Op op, const value_ref& lhs, const value_ref& rhs) {
+    if (lhs.data() != NULL && rhs.data() != NULL) {
+      return compare(op, *lhs.data(), *rhs.data());
+    }
+    return compare(op, lhs.to_data(), rhs.to_data());
+  }
+
+  // operand of a comparison, a nested condition compares as a boolean
+  value_ref value(size_t index, const Context& data) const {
+    static const auto_data true_data(true);
+    static const auto_data false_data(false);
+    const Node& node = m_nodes[index];
+    if (node.op == OP_VALUE) {
+      return lookup_value(node.path, data);
+    }
+    return eval(index, data) ? true_data : false_data;
+  }
+
+  bool eval(size_t index, const Context& data) const {
+    const Node& node = m_nodes[index];
+    switch (node.op) {
+      case OP_VALUE: {
+        return lookup_value(node.path, data).is_true();
+      }
+      case OP_NOT: {
+        return !eval(node.lhs, data);
+      }
+      case OP_AND: {
+        return eval(node.lhs, data) && eval(node.rhs, data);
+      }
+      case OP_OR: {
+        return eval(node.lhs, data) || eval(node.rhs, data);
+      }
+      default:
+        return compare(node.op, value(node.lhs, data), value(node.rhs, data));
+    }
+  }
+
+  std::vector<Node> m_nodes;
+  size_t m_root = 0;
+};
+
+
+
+//////////////////////////////////////////////////////////////////////////
+// output sink
+// render writes every piece of output into a sink as soon as it's known,
+// so bytes are copied once from the template or data into the destination
+//////////////////////////////////////////////////////////////////////////
+class OutputSink {
+ public:
+  virtual ~OutputSink() {}
+  virtual void write(const char* data, size_t size) = 0;
+  // static template text, valid for as long as the template is, so a
+  // sink may keep the pointer instead of copying
+  virtual void write_static(const char* data, size_t size) {
+    write(data, size);
+  }
+};
+
+// append to a string
+class StringSink : public OutputSink {
+ public:
+  explicit StringSink(std::string* str) : m_str(str) {}
+  void write(const char* data, size_t size) {
+    m_str->append(data, size);
+  }
+ private:
+  std::string* m_str;
+};
+
+class StreamSink : public OutputSink {
+ public:
+  explicit StreamSink(std::ostream* os) : m_os(os) {}
+  void write(const char* data, size_t size) {
+    m_os->write(data, size);
+  }
+ private:
+  std::ostream* m_os;
+};
+
+class FileSink : public OutputSink {
+ public:
+  explicit FileSink(FILE* file) : m_file(file) {}
+  void write(const char* data, size_t size) {
+    if (m_error == 0 && fwrite(data, 1, size, m_file) != size) {
+      m_error = errno != 0 ? errno : EIO;
+    }
+  }
+  // errno of the first failed write, 0 if none failed; later writes are
+  // dropped, so the output is never missing a piece in the middle.
+  // Buffered data can still fail in fflush/fclose
+  int error() const { return m_error; }
+ private:
+  FILE* m_file;
+  int m_error = 0;
+};
+
+#if defined(__unix__) || defined(__APPLE__)
+// unbuffered, every write is a write(2) call
+class FdSink : public OutputSink {
+ public:
+  explicit FdSink(int fd) : m_fd(fd) {}
+  void write(const char* data, size_t size) {
+    while (m_error == 0 && size > 0) {
+      ssize_t n = ::write(m_fd, data, size);
+      if (n < 0) {
+        if (errno != EINTR) {
+          m_error = errno;
+        }
+        continue;
+      }
+      data += n;
+      size -= n;
+    }
+  }
+  // errno of the first failed write (EPIPE, ENOSPC...), 0 if none
+  // failed; later writes are dropped
+  int error() const { return m_error; }
+ private:
+  int m_fd;
+  int m_error = 0;
+};
+
+// collects output as iovec segments for writev/sendmsg: static text
+// points into the template, other writes are copied into scratch blocks
+// that are reused after clear. Segments stay valid until clear, and
+// static ones only while the Template lives; parse() copies all text.
+class IovecSink : public OutputSink {
+ public:
+  IovecSink() {}
+  IovecSink(const IovecSink&) = delete;
+  IovecSink& operator=(const IovecSink&) = delete;
+
+  void write(const char* data, size_t size) {
+    if (size == 0) {
+      return;
+    }
+    if (m_blocks.empty() || m_used + size > m_blocks[m_block].size) {
+      next_block(size);
+    }
+    char* dest = m_blocks[m_block].data.get() + m_used;
+    memcpy(dest, data, size);
+    m_used += size;
+    append(dest, size);
+  }
+
+  void write_static(const char* data, size_t size) {
+    if (size > 0) {
+      append(data, size);
+    }
+  }
+
+  const std::vector<iovec>& segments() const { return m_segments; }
+  // total bytes in all segments
+  size_t size() const { return m_size; }
+
+  void clear() {
+    m_segments.clear();
+    m_size = 0;
+    m_block = 0;
+    m_used = 0;
+  }
+
+  // writes all segments to fd, IOV_MAX at a time, resuming after short
+  // writes; false with errno set on error
+  bool writev(int fd) const {
+    std::vector<iovec> iov(m_segments);
+    size_t first = 0;
+    while (first < iov.size()) {
+      int count = static_cast<int>(std::min<size_t>(iov.size() - first,
+                                                    IOV_MAX));
+      ssize_t n = ::writev(fd, &iov[first], count);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      size_t left = n;
+      while (first < iov.size() && left >= iov[first].iov_len) {
+        left -= iov[first++].iov_len;
+      }
+      if (left > 0) {
+        iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + left;
+        iov[first].iov_len -= left;
+      }
+    }
+    return true;
+  }
+
+ private:
+  static constexpr size_t kBlockSize = 4096;
+
+  struct Block {
+    std::unique_ptr<char[]> data;
+    size_t size;
+  };
+
+  // moves to the next block that fits size, allocating one if needed
+  void next_block(size_t size) {
+    if (!m_blocks.empty()) {
+      m_block++;
+    }
+    while (m_block < m_blocks.size() && m_blocks[m_block].size < size) {
+      m_block++;
+    }
+    if (m_block == m_blocks.size()) {
+      size_t block_size = std::max(size, kBlockSize);
+      m_blocks.push_back(Block{std::unique_ptr<char[]>(new char[block_size]),
+                               block_size});
+    }
+    m_used = 0;
+  }
+
+  // extends the last segment when data follows it in memory
+  void append(const char* data, size_t size) {
+    if (!m_segments.empty()) {
+      iovec& last = m_segments.back();
+      if (static_cast<const char*>(last.iov_base) + last.iov_len == data) {
+        last.iov_len += size;
+        m_size += size;
+        return;
+      }
+    }
+    m_segments.push_back(iovec{const_cast<char*>(data), size});
+    m_size += size;
+  }
+
+  std::vector<iovec> m_segments;
+  size_t m_size = 0;
+  std::vector<Block> m_blocks;
+  size_t m_block = 0;
+  size_t m_used = 0;
+};
+#endif
+
+class CallbackSink : public OutputSink {
+ public:
+  using callback = std::function<void(const char* data, size_t size)>;
+  explicit CallbackSink(callback cb) : m_cb(std::move(cb)) {}
+  void write(const char* data, size_t size) {
+    m_cb(data, size);
+  }
+ private:
+  callback m_cb;
+};
+
+
+//////////////////////////////////////////////////////////////////////////
+// number formatting
+// locale independent, digits are written into a caller buffer
+//////////////////////////////////////////////////////////////////////////
+// writes v at the end of buf, two digits per division, returns the start
+// buf needs kIntBufferSize bytes
+static const size_t kIntBufferSize = 20;
+inline char* format_int(int64_t v, char* buf) {
+  static const char digits[] =
+      "00010203040506070809101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+  uint64_t u = v < 0 ? 0 - static_cast<uint64_t>(v) : v;
+  char* p = buf + kIntBufferSize;
+  while (u >= 100) {
+    size_t i = (u % 100) * 2;
+    u /= 100;
+    p -= 2;
+    memcpy(p, digits + i, 2);
+  }
+  if (u < 10) {
+    *--p = static_cast<char>('0' + u);
+  } else {
+    p -= 2;
+    memcpy(p, digits + u * 2, 2);
+  }
+  if (v < 0) {
+    *--p = '-';
+  }
+  return p;
+}
+
+// shortest round-trip text when precision < 0, otherwise fixed with
+// precision digits (at most 100), returns the length
+// buf needs kFloatBufferSize bytes, enough for fixed 1e308
+static const size_t kFloatBufferSize = 512;
+inline size_t format_float(double v, int precision, char* buf) {
+  std::to_chars_result ret;
+  if (precision < 0) {
+    ret = std::to_chars(buf, buf + kFloatBufferSize, v);
+  } else {
+    ret = std::to_chars(buf, buf + kFloatBufferSize, v,
+                        std::chars_format::fixed, std::min(precision, 100));
+  }
+  return ret.ptr - buf;
+}
+
+// write a variable's value, maps, lists and null write nothing
+inline void write_value(const auto_data& value, OutputSink* out,
+                        const RenderOptions& options = RenderOptions()) {
+  switch (value.Type()) {
+    case auto_data::data_type::string: {
+      std::string_view str = value.str();
+      out->write(str.data(), str.size());
+      break;
+    }
+    case auto_data::data_type::boolean: {
+      bool b = value;
+      if (b) {
+        out->write("true", 4);
+      } else {
+        out->write("false", 5);
+      }
+      break;
+    }
+    case auto_data::data_type::number_integer: {
+      char temp[kIntBufferSize];
+      const char* p = format_int(value, temp);
+      out->write(p, temp + kIntBufferSize - p);
+      break;
+    }
+    case auto_data::data_type::number_float: {
+      char temp[kFloatBufferSize];
+      size_t size = format_float(value, options.float_precision, temp);
+      out->write(temp, size);
+      break;
+    }
+    case auto_data::data_type::lazy: {
+      write_value(value.evaluate(), out, options);
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+// struct strings are written in place, structs and lists write nothing
+inline void write_value(const value_ref& value, OutputSink* out,
+                        const RenderOptions& options = RenderOptions()) {
+  if (value.data() != NULL) {
+    write_value(*value.data(), out, options);
+    return;
+  }
+  const TypeInfo* type = value.type();
+  if (type->kind == TypeInfo::STRING) {
+    std::string_view str = type->str(value.ptr());
+    out->write(str.data(), str.size());
+  } else if (type->kind == TypeInfo::SCALAR) {
+    write_value(type->scalar(value.ptr()), out, options);
+  }
+}
+
+
+// token classes
+typedef enum  {
+  TOKEN_TYPE_NONE,
+  TOKEN_TYPE_TEXT,
+  TOKEN_TYPE_VAR,
+  TOKEN_TYPE_IF,
+  TOKEN_TYPE_FOR,
+  TOKEN_TYPE_ENDIF,
+  TOKEN_TYPE_ENDFOR,
+} TokenType;
+
+
+
+class Token;
+// tokens are owned by a TokenPool, vectors and lists only point to them
+using token_vector = std::vector<Token*>;
+
+// children of a block token, an array allocated in the TokenPool
+class TokenList {
+ public:
+  TokenList() : m_tokens(NULL), m_size(0) {}
+  TokenList(Token** tokens, size_t size) : m_tokens(tokens), m_size(size) {}
+  size_t size() const { return m_size; }
+  bool empty() const { return m_size == 0; }
+  Token* operator[](size_t index) const { return m_tokens[index]; }
+  Token* const* begin() const { return m_tokens; }
+  Token* const* end() const { return m_tokens + m_size; }
+
+ private:
+  Token** m_tokens;
+  size_t m_size;
+};
+
+// Template tokens
+// base class for all token types
+class Token {
+ public:
+  virtual ~Token() {}
+  virtual TokenType gettype() const = 0;
+  virtual void set_children(const TokenList&) {
+    printf("this token can't set child\n");
+  }
+  virtual void render(const Context&, OutputSink*) const {}
+  std::string get_text(const auto_data& data) const {
+    std::string str;
+    StringSink out(&str);
+    render(data, &out);
+    return str;
+  }
+};
+
+
+
+
+// normal text
+// m_text is a slice of the template text, the template must outlive it
+// render is only used by the one-shot parse, whose text the caller may
+// free right after, so it is copied with write, not write_static
+class TokenText : public Token {
+ private:
+  std::string_view m_text;
+ public:
+  explicit TokenText(std::string_view text) : m_text(text) {}
+  TokenType gettype() const { return TOKEN_TYPE_TEXT;}
+  size_t size() const { return m_text.size(); }
+  std::string_view text() const { return m_text; }
+  void render(const Context&, OutputSink* out) const {
+    out->write(m_text.data(), m_text.size());
+  }
+};
+
+// variable
+class TokenVar : public Token {
+ private:
+  VarPath m_path;
+
+ public:
+  explicit TokenVar(std::string_view key) : m_path(key) {}
+  TokenType gettype() const { return TOKEN_TYPE_VAR;}
+  const VarPath& path() const { return m_path; }
+  void render(const Context& ctx, OutputSink* out) const {
+    write_value(lookup_value(m_path, ctx), out, ctx.options());
+  }
+};
+
+// for block
+class TokenFor : public Token {
+ public:
+  std::string m_key;
+  std::string m_val;
+  TokenList m_children;
+  // 拆分出来
+  explicit TokenFor(std::string expr) {
+    std::vector<std::string> elements;
+    char split[] = " ";
+    SplitString(expr, split, &elements);
+    if (elements.size() != 4 || elements[0] != "for" ||
+        elements[2] != "in") {
+      throw TemplateException("error syntax '" + expr + "'");
+    }
+    m_val = elements[1];
+    m_key = elements[3];
+    m_list = VarPath(m_key);
+  }
+  TokenType gettype() const { return TOKEN_TYPE_FOR;}
+  void set_children(const TokenList &children) {
+    m_children = children;
+  }
+  const TokenList &get_children() const {
+    return m_children;
+  }
+  const VarPath& list() const { return m_list; }
+  // each iteration binds m_val to the element in a scope on the stack,
+  // nothing is copied and outer variables stay visible
+  void render(const Context& ctx, OutputSink* out) const {
+    value_ref l = lookup_value(m_list, ctx);
+    int listSize = l.size();
+    for (int i = 0; i < listSize; i++) {
+      Context scope(&ctx, m_val, l.at(i));
+      for (size_t j = 0; j < m_children.size(); ++j) {
+        m_children[j]->render(scope, out);
+      }
+    }
+  }
+
+ private:
+  VarPath m_list;
+};
+
+// if block
+class TokenIf : public Token {
+ public:
+  std::string m_expr;
+  TokenList m_children;
+  // condition is parsed once here, is_true only evaluates the tree
+  explicit TokenIf(std::string expr) : m_expr(expr) {
+    if (m_expr.compare(0, 2, "if") != 0 ||
+        (m_expr.size() > 2 && m_expr[2] != ' ' && m_expr[2] != '(')) {
+      throw TemplateException("unknown statement '" + m_expr + "'");
+    }
+    m_cond = Expression(std::string_view(m_expr).substr(2));
+  }
+  TokenType gettype() const { return TOKEN_TYPE_IF;}
+  void set_children(const TokenList &children) {
+    m_children = children;
+  }
+  const TokenList &get_children() const { return m_children;}
+  void render(const Context& ctx, OutputSink* out) const {
+    if (is_true(ctx)) {
+      for (size_t j = 0; j < m_children.size(); ++j) {
+        m_children[j]->render(ctx, out);
+      }
+    } else {
+      // printf("is not true:%s\n", m_expr.c_str());
+    }
+  }
+  bool is_true(const Context& ctx) const {
+    return m_cond.is_true(ctx);
+  }
+  const Expression& condition() const { return m_cond; }
+
+ private:
+  Expression m_cond;
+};
+
+// end of block
+// end of control block
+class TokenEnd : public Token {
+ private:
+  std::string m_type;
+ public:
+  explicit TokenEnd(std::string text) : m_type(text) {
+    if (m_type != "endfor" && m_type != "endif") {
+      throw TemplateException("unknown statement '" + m_type + "'");
+    }
+  }
+  TokenType gettype() const {
+    return m_type == "endfor" ? TOKEN_TYPE_ENDFOR : TOKEN_TYPE_ENDIF;
+  }
+};
+
+
+
+// owns all tokens of a template, tokens and their child lists are
+// allocated from one arena and point to each other with plain pointers,
+// destroying the pool runs the token destructors and frees the arena
+class TokenPool {
+ public:
+  TokenPool() : m_arena(kInitialSize) {}
+  ~TokenPool() {
+    for (size_t i = m_tokens.size(); i > 0; --i) {
+      m_tokens[i-1]->~Token();
+    }
+  }
+  TokenPool(const TokenPool&) = delete;
+  TokenPool& operator=(const TokenPool&) = delete;
+
+  template <class T, class... Args>
+  T* make(Args&&... args) {
+    void* p = m_arena.allocate(sizeof(T), alignof(T));
+    m_tokens.push_back(NULL);  // so push_back can't throw after construct
+    T* token;
+    try {
+      token = new (p) T(std::forward<Args>(args)...);
+    } catch (...) {
+      m_tokens.pop_back();
+      throw;
+    }
+    m_tokens.back() = token;
+    return token;
+  }
+
+  TokenList make_list(const token_vector& tokens) {
+    if (tokens.empty()) {
+      return TokenList();
+    }
+    Token** p = static_cast<Token**>(
+        m_arena.allocate(sizeof(Token*) * tokens.size(), alignof(Token*)));
+    std::copy(tokens.begin(), tokens.end(), p);
+    return TokenList(p, tokens.size());
+  }
+
+ private:
+  static const size_t kInitialSize = 4096;
+  std::pmr::monotonic_buffer_resource m_arena;
+  token_vector m_tokens;
+};
+
+
+//////////////////////////////////////////////////////////////////////////
+// Program
+// a token tree flattened into a contiguous array of instructions, run
+// by a switch loop without virtual calls or walking child lists.
+// Instructions point into the tokens, the tree must outlive the program.
+//////////////////////////////////////////////////////////////////////////
+class Program {
+ public:
+  enum Op : uint8_t {
+    OP_TEXT,           // write text
+    OP_VAR,            // write value of path
+    OP_JUMP_IF_FALSE,  // jump when cond is false
+    OP_LOOP_BEGIN,     // bind first element of path, jump when empty
+    OP_LOOP_NEXT,      // bind next element and jump back, or leave loop
+  };
+  struct Instruction {
+    Op op;
+    uint32_t jump;
+    union {
+      struct {
+        const char* data;
+        size_t size;
+      } text;
+      const VarPath* path;
+      const Expression* cond;
+      const TokenFor* loop;
+    };
+  };
+
+  Program() {}
+  // flattens the tree iteratively, so deep nesting doesn't recurse
+  explicit Program(const TokenList& tree) {
+    struct Pending {
+      const TokenList* list;
+      size_t next;
+      Token* block;
+      size_t begin;  // index of the block's first instruction
+    };
+    std::vector<Pending> pending;
+    pending.push_back(Pending{&tree, 0, NULL, 0});
+    size_t depth = 0;
+    while (!pending.empty()) {
+      Pending& top = pending.back();
+      if (top.next == top.list->size()) {
+        if (top.block != NULL && top.block->gettype() == TOKEN_TYPE_FOR) {
+          Instruction& next = emit(OP_LOOP_NEXT);
+          next.jump = top.begin + 1;
+          next.loop = static_cast<TokenFor*>(top.block);
+          depth--;
+        }
+        if (top.block != NULL) {
+          m_code[top.begin].jump = m_code.size();
+        }
+        pending.pop_back();
+        continue;
+      }
+      Token* token = (*top.list)[top.next++];
+      switch (token->gettype()) {
+        case TOKEN_TYPE_TEXT: {
+          std::string_view text = static_cast<TokenText*>(token)->text();
+          // merge with the previous text when adjacent in the template
+          if (!m_code.empty() && m_code.back().op == OP_TEXT &&
+              m_code.back().text.data + m_code.back().text.size ==
+              text.data()) {
+            m_code.back().text.size += text.size();
+          } else {
+            Instruction& ins = emit(OP_TEXT);
+            ins.text.data = text.data();
+            ins.text.size = text.size();
+          }
+          break;
+        }
+        case TOKEN_TYPE_VAR: {
+          emit(OP_VAR).path = &static_cast<TokenVar*>(token)->path();
+          break;
+        }
+        case TOKEN_TYPE_IF: {
+          TokenIf* block = static_cast<TokenIf*>(token);
+          size_t begin = m_code.size();
+          emit(OP_JUMP_IF_FALSE).cond = &block->condition();
+          pending.push_back(Pending{&block->get_children(), 0, block, begin});
+          break;
+        }
+        case TOKEN_TYPE_FOR: {
+          TokenFor* block = static_cast<TokenFor*>(token);
+          size_t begin = m_code.size();
+          emit(OP_LOOP_BEGIN).loop = block;
+          pending.push_back(Pending{&block->get_children(), 0, block, begin});
+          depth++;
+          m_max_depth = std::max(m_max_depth, depth);
+          break;
+        }
+        default:
+          break;
+      }
+    }
+  }
+
+  const std::vector<Instruction>& code() const { return m_code; }
+
+  void run(const Context& root, OutputSink* out) const {
+    FrameStack frames(m_max_depth);
+    run(root, 0, m_code.size(), true, frames.get(), out);
+  }
+
+ private:
+  static const size_t kInlineFrames = 8;
+
+  // state of a running loop, scope binds the current element
+  struct Frame {
+    value_ref list;
+    int index;
+    int size;
+    Context scope;
+  };
+
+  // uninitialized storage, a frame is constructed when its loop begins
+  // and destroyed when it ends, so unused frames cost nothing
+  class FrameStack {
+   public:
+    explicit FrameStack(size_t size)
+        : m_heap(size > kInlineFrames ?
+                 std::allocator<Frame>().allocate(size) : NULL),
+          m_size(size) {}
+    ~FrameStack() {
+      if (m_heap != NULL) {
+        std::allocator<Frame>().deallocate(m_heap, m_size);
+      }
+    }
+    FrameStack(const FrameStack&) = delete;
+    FrameStack& operator=(const FrameStack&) = delete;
+
+    Frame* get() {
+      return m_heap != NULL ? m_heap : reinterpret_cast<Frame*>(m_inline);
+    }
+
+   private:
+    alignas(Frame) unsigned char m_inline[kInlineFrames * sizeof(Frame)];
+    Frame* m_heap;
+    size_t m_size;
+  };
+
+  Instruction& emit(Op op) {
+    m_code.push_back(Instruction());
+    m_code.back().op = op;
+    m_code.back().jump = 0;
+    return m_code.back();
+  }
+
+  // renders the loop at ip with its body split into chunks on the pool,
+  // each chunk into its own buffer, loops inside the body run serially
+  void run_parallel(const Context& ctx, size_t ip, const value_ref& list,
+                    size_t list_size, OutputSink* out) const {
+    const Instruction& ins = m_code[ip];
+    ThreadPool* pool = ctx.options().pool;
+    size_t chunks = std::min(list_size, pool->size() * 4);
+    size_t chunk_size = (list_size + chunks - 1) / chunks;
+    std::vector<std::string> buffers(chunks);
+    pool->parallel_for(chunks, 1, [&](size_t c) {
+      StringSink sink(&buffers[c]);
+      FrameStack frames(m_max_depth);
+      size_t end = std::min(list_size, (c + 1) * chunk_size);
+      for (size_t i = c * chunk_size; i < end; ++i) {
+        Context scope(&ctx, ins.loop->m_val, list.at(static_cast<int>(i)));
+        run(scope, ip + 1, ins.jump - 1, false, frames.get(), &sink);
+      }
+    });
+    for (const std::string& buffer : buffers) {
+      out->write(buffer.data(), buffer.size());
+    }
+  }
+
+  // runs instructions [ip, end), which must be whole blocks
+  void run(const Context& root, size_t ip, size_t end, bool parallel,
+           Frame* frames, OutputSink* out) const {
+    const Instruction* code = m_code.data();
+    const Context* ctx = &root;
+    Frame* frame = NULL;  // innermost running loop
+    size_t depth = 0;
+    while (ip < end) {
+      const Instruction& ins = code[ip];
+      switch (ins.op) {
+        case OP_TEXT: {
+          out->write_static(ins.text.data, ins.text.size);
+          ip++;
+          break;
+        }
+        case OP_VAR: {
+          write_value(lookup_value(*ins.path, *ctx), out, ctx->options());
+          ip++;
+          break;
+        }
+        case OP_JUMP_IF_FALSE: {
+          ip = ins.cond->is_true(*ctx) ? ip + 1 : ins.jump;
+          break;
+        }
+        case OP_LOOP_BEGIN: {
+          value_ref list = lookup_value(ins.loop->list(), *ctx);
+          int list_size = list.size();
+          if (list_size == 0) {
+            ip = ins.jump;
+            break;
+          }
+          if (parallel && ctx->options().pool != NULL &&
+              static_cast<size_t>(list_size) >=
+              ctx->options().parallel_min_items) {
+            run_parallel(*ctx, ip, list, list_size, out);
+            ip = ins.jump;
+            break;
+          }
+          frame = new (&frames[depth++]) Frame{
+              list, 0, list_size, Context(ctx, ins.loop->m_val, list.at(0))};
+          ctx = &frame->scope;
+          ip++;
+          break;
+        }
+        case OP_LOOP_NEXT: {
+          if (++frame->index < frame->size) {
+            frame->scope.rebind(frame->list.at(frame->index));
+            ip = ins.jump;
+          } else {
+            ctx = frame->scope.parent();
+            frame->~Frame();
+            depth--;
+            frame = depth > 0 ? &frames[depth-1] : NULL;
+            ip++;
+          }
+          break;
+        }
+      }
+    }
+  }
+
+  std::vector<Instruction> m_code;
+  size_t m_max_depth = 0;
+};
+
+
+//////////////////////////////////////////////////////////////////////////
+// delimiter scan
+// finds every '{' and '}' of a template in one pass, 16 or 32 bytes at
+// a time with SSE2/AVX2 when the cpu has it, so tokenize only visits the
+// delimiters instead of searching the mostly static text again and again
+//////////////////////////////////////////////////////////////////////////
+enum SimdLevel {
+  SIMD_NONE,
+  SIMD_SSE2,
+  SIMD_AVX2,
+};
+
+#ifdef CPPTEMPL_X86_SIMD
+// both return how many bytes were scanned, the tail is left to the caller
+__attribute__((target("sse2")))
+inline size_t scan_delimiters_sse2(const char* text, size_t size,
+                                   std::vector<size_t>* positions) {
+  const __m128i open = _mm_set1_epi8('{');
+  const __m128i close = _mm_set1_epi8('}');
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text+i));
+    unsigned mask = _mm_movemask_epi8(_mm_or_si128(
+        _mm_cmpeq_epi8(block, open), _mm_cmpeq_epi8(block, close)));
+    while (mask != 0) {
+      positions->push_back(i + __builtin_ctz(mask));
+      mask &= mask - 1;
+    }
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+inline size_t scan_delimiters_avx2(const char* text, size_t size,
+                                   std::vector<size_t>* positions) {
+  const __m256i open = _mm256_set1_epi8('{');
+  const __m256i close = _mm256_set1_epi8('}');
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    __m256i block = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(text+i));
+    unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(
+        _mm256_cmpeq_epi8(block, open), _mm256_cmpeq_epi8(block, close)));
+    while (mask != 0) {
+      positions->push_back(i + __builtin_ctz(mask));
+      mask &= mask - 1;
+    }
+  }
+  return i;
+}
+#endif
+
+// best level supported by this cpu, detected once
+inline SimdLevel simd_level() {
+#ifdef CPPTEMPL_X86_SIMD
+  static const SimdLevel level = []() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      return SIMD_AVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+      return SIMD_SSE2;
+    }
+    return SIMD_NONE;
+  }();
+  return level;
+#else
+  return SIMD_NONE;
+#endif
+}
+
+// appends the offsets of all '{' and '}' in text, in order
+inline void scan_delimiters(std::string_view text,
+                            std::vector<size_t>* positions,
+                            SimdLevel level = simd_level()) {
+  const char* data = text.data();
+  size_t i = 0;
+#ifdef CPPTEMPL_X86_SIMD
+  if (level == SIMD_AVX2) {
+    i = scan_delimiters_avx2(data, text.size(), positions);
+  } else if (level == SIMD_SSE2) {
+    i = scan_delimiters_sse2(data, text.size(), positions);
+  }
+#else
+  (void)level;
+#endif
+  for (; i < text.size(); ++i) {
+    if (data[i] == '{' || data[i] == '}') {
+      positions->push_back(i);
+    }
+  }
+}
+
+// forward search over the delimiter offsets of a text, replaces
+// text.find('{', pos)/text.find('}', pos) in tokenize
+class DelimiterIndex {
+ public:
+  explicit DelimiterIndex(std::string_view text) : m_text(text) {
+    m_positions.reserve(text.size() / 64 + 16);
+    scan_delimiters(text, &m_positions);
+  }
+
+  // first c at or after pos, pos must not decrease between calls
+  size_t find(char c, size_t pos) {
+    while (m_next < m_positions.size() && m_positions[m_next] < pos) {
+      m_next++;
+    }
+    int index = c == '{' ? 0 : 1;
+    if (m_exhausted[index]) {
+      return std::string_view::npos;
+    }
+    for (size_t i = m_next; i < m_positions.size(); ++i) {
+      if (m_text[m_positions[i]] == c) {
+        return m_positions[i];
+      }
+    }
+    m_exhausted[index] = true;
+    return std::string_view::npos;
+  }
+
+ private:
+  std::string_view m_text;
+  std::vector<size_t> m_positions;
+  size_t m_next = 0;
+  bool m_exhausted[2] = {false, false};  // no more '{' / '}' ahead
+};
+
+
+class Template;
+
+class Parser {
+  friend class Template;
+
+ private:
+    //////////////////////////////////////////////////////////////////////////
     // tokenize
     // parses a template into tokens (text, for, if, variable)
     //////////////////////////////////////////////////////////////////////////
-    static token_vector tokenize(std::string text) {
+    // single forward scan, tokens keep slices of text and never copy it,
+    // so text must outlive the returned tokens
+    static token_vector tokenize(std::string_view text, TokenPool* pool) {
         token_vector tokens;
-        while (!text.empty()) {
-            size_t pos = text.find("{");
-            if (pos == std::string::npos) {
-                if (!text.empty()) {
-                    tokens.push_back(std::shared_ptr<Token>(new TokenText(text)));
-                }
+        DelimiterIndex delimiters(text);
+        size_t pos = 0;
+        while (pos < text.size()) {
+            size_t open = delimiters.find('{', pos);
+            if (open == std::string_view::npos) {
+                tokens.push_back(pool->make<TokenText>(text.substr(pos)));
                 return tokens;
             }
-            std::string pre_text = text.substr(0, pos);
-            if (!pre_text.empty()) {
-                tokens.push_back(std::shared_ptr<Token>(new TokenText(pre_text)));
+            if (open > pos) {
+                tokens.push_back(
+                    pool->make<TokenText>(text.substr(pos, open-pos)));
             }
-            text = text.substr(pos+1);
-            if (text.empty()) {
-                tokens.push_back(std::shared_ptr<Token>(new TokenText("{")));
+            pos = open+1;
+            if (pos == text.size()) {
+                tokens.push_back(pool->make<TokenText>(text.substr(open, 1)));
                 return tokens;
             }
             // variable
-            if (text[0] == '$') {
-                pos = text.find("}");
-                if (pos != std::string::npos) {
-                    tokens.push_back(
-                        std::shared_ptr<Token>(new TokenVar(text.substr(1, pos-1))));
-                    text = text.substr(pos+1);
+            if (text[pos] == '$') {
+                size_t close = delimiters.find('}', pos);
+                if (close != std::string_view::npos) {
+                    tokens.push_back(pool->make<TokenVar>(
+                        text.substr(pos+1, close-pos-1)));
+                    pos = close+1;
                 }
-            } else if (text[0] == '%') {  // control statement
-                pos = text.find("}");
-                if (pos != std::string::npos) {
-                    std::string expression = text.substr(1, pos-2);
-                    // strim
-                    size_t spos = expression.find_first_not_of(" ");
-                    if (spos != 0 && spos != std::string::npos) {
-                        expression = expression.substr(spos);
+            } else if (text[pos] == '%') {  // control statement
+                size_t close = delimiters.find('}', pos);
+                if (close != std::string_view::npos) {
+                    // between "{%" and "%}"
+                    std::string_view expression;
+                    if (close > pos+1) {
+                        expression = text.substr(pos+1, close-pos-2);
                     }
-                    size_t epos = expression.find_last_not_of(" ");
-                    if (epos != expression.length() && epos != std::string::npos) {
-                        expression = expression.substr(0, epos+1);
+                    // strim
+                    size_t spos = expression.find_first_not_of(' ');
+                    if (spos == std::string_view::npos) {
+                        expression = std::string_view();
+                    } else {
+                        size_t epos = expression.find_last_not_of(' ');
+                        expression = expression.substr(spos, epos-spos+1);
                     }
-                    text = text.substr(pos+1);
-                    if (expression.find_first_of("for") == 0) {
-                        tokens.push_back(std::shared_ptr<Token>(new TokenFor(expression)));
-                    } else if (expression.find_first_of("if") == 0) {
-                        tokens.push_back(std::shared_ptr<Token>(new TokenIf(expression)));
+                    pos = close+1;
+                    std::string expr(expression);
+                    // dispatch on the first word, "if(a)" has no space
+                    std::string_view word =
+                        expression.substr(0, expression.find_first_of(" ("));
+                    if (word == "for") {
+                        tokens.push_back(pool->make<TokenFor>(expr));
+                    } else if (word == "if") {
+                        tokens.push_back(pool->make<TokenIf>(expr));
                     } else {
-                        tokens.push_back(std::shared_ptr<Token>(
-                            new TokenEnd(expression)));
+                        tokens.push_back(pool->make<TokenEnd>(expr));
                     }
                 }
             } else {
-                tokens.push_back(std::shared_ptr<Token>(new TokenText("{")));
+                tokens.push_back(pool->make<TokenText>(text.substr(open, 1)));
             }
         }
         return tokens;
@@ -639,49 +2572,610 @@ class Parser {
 
     //////////////////////////////////////////////////////////////////////////
     // parse_tree
-    // recursively parses list of tokens into a tree
+    // parses list of tokens into a tree in one pass, open blocks are kept
+    // in an explicit stack, so nesting depth doesn't grow the call stack
     //////////////////////////////////////////////////////////////////////////
-    static void parse_tree(token_vector* tokens,
-                    token_vector* tree,
-                    TokenType until = TOKEN_TYPE_NONE) {
-        while (!tokens->empty()) {
-            std::shared_ptr<Token> token = tokens->at(0);
-            tokens->erase(tokens->begin());
-            if (token->gettype() == TOKEN_TYPE_FOR) {
-                token_vector children;
-                parse_tree(tokens, &children, TOKEN_TYPE_ENDFOR);
-                token->set_children(children);
-            } else if (token->gettype() == TOKEN_TYPE_IF) {
-                token_vector children;
-                parse_tree(tokens, &children, TOKEN_TYPE_ENDIF);
-                token->set_children(children);
-            } else if (token->gettype() == until) {
-                return;
+    static void parse_tree(const token_vector& tokens, TokenPool* pool,
+                           TokenList* tree) {
+        struct Block {
+            Token* token;
+            token_vector children;
+        };
+        std::vector<Block> blocks;
+        token_vector root;
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            Token* token = tokens[i];
+            TokenType type = token->gettype();
+            if (type == TOKEN_TYPE_FOR || type == TOKEN_TYPE_IF) {
+                blocks.push_back(Block{token, token_vector()});
+                continue;
+            }
+            if (type == TOKEN_TYPE_ENDFOR || type == TOKEN_TYPE_ENDIF) {
+                TokenType open = type == TOKEN_TYPE_ENDFOR ? TOKEN_TYPE_FOR
+                                                           : TOKEN_TYPE_IF;
+                const char* name = type == TOKEN_TYPE_ENDFOR ? "endfor"
+                                                             : "endif";
+                if (blocks.empty() || blocks.back().token->gettype() != open) {
+                    throw TemplateException(
+                        std::string("unmatched {% ") + name + " %}");
+                }
+                Block block = std::move(blocks.back());
+                blocks.pop_back();
+                block.token->set_children(pool->make_list(block.children));
+                token_vector* parent = blocks.empty() ? &root
+                                                      : &blocks.back().children;
+                parent->push_back(block.token);
+                continue;
+            }
+            if (blocks.empty()) {
+                root.push_back(token);
+            } else {
+                blocks.back().children.push_back(token);
             }
-            tree->push_back(token);
         }
+        if (!blocks.empty()) {
+            throw TemplateException(
+                blocks.back().token->gettype() == TOKEN_TYPE_FOR
+                ? "missing {% endfor %}" : "missing {% endif %}");
+        }
+        *tree = pool->make_list(root);
     }
 
  public:
-    static std::string parse(std::string templ_text, const auto_data& data) {
-        token_vector tokens;
-        tokens = tokenize(templ_text);
-        token_vector tree;
-        parse_tree(&tokens, &tree);
-
+    static std::string parse(std::string_view templ_text,
+                             const auto_data& data) {
         std::string str = "";
+        StringSink out(&str);
+        parse(templ_text, data, &out);
+        return str;
+    }
+
+    static void parse(std::string_view templ_text,
+                      const auto_data& data,
+                      OutputSink* out) {
+        TokenPool pool;
+        token_vector tokens;
+        tokens = tokenize(templ_text, &pool);
+        TokenList tree;
+        parse_tree(tokens, &pool, &tree);
+        Context ctx(data);
         for (size_t i = 0 ; i < tree.size() ; ++i) {
-            str =  str + tree[i]->get_text(data);
+            tree[i]->render(ctx, out);
         }
-        return str;
     }
 
 };
 
-inline std::string parse(std::string templ_text, const auto_data& data) {
+// compiled template
+// tokenize and parse_tree run once in constructor, render can be called
+// any number of times with different data
+// A Template is immutable once constructed: tokens and the program are
+// only read by render, and the output size statistics are atomic, so
+// one Template can be rendered from any number of threads at once
+// without locking. The data rendered must not be modified meanwhile.
+class Template {
+ public:
+  explicit Template(std::string templ_text,
+                    const RenderOptions& options = RenderOptions())
+      : m_options(options),
+        m_text(std::make_shared<const std::string>(std::move(templ_text))),
+        m_pool(std::make_shared<TokenPool>()),
+        m_stats(std::make_shared<Stats>()) {
+    // literals are owned by the template, which may outlive an arena
+    // active while it's compiled (TemplateCache compiles on a request)
+    ArenaScope heap(NULL);
+    token_vector tokens = Parser::tokenize(*m_text, m_pool.get());
+    for (size_t i = 0; i < tokens.size(); ++i) {
+      if (tokens[i]->gettype() == TOKEN_TYPE_TEXT) {
+        m_static_size += static_cast<TokenText*>(tokens[i])->size();
+      }
+    }
+    Parser::parse_tree(tokens, m_pool.get(), &m_tree);
+    m_program = std::make_shared<const Program>(m_tree);
+  }
+
+  std::string render(const auto_data& data) const {
+    std::string str = "";
+    render_into(data, &str);
+    return str;
+  }
+
+  // append output to str, str is reserved once from estimate_size
+  void render_into(const auto_data& data, std::string* str) const {
+    size_t start = str->size();
+    str->reserve(start + estimate_size());
+    StringSink out(str);
+    render(data, &out);
+    record_size(str->size() - start);
+  }
+
+  // total length of static text in the template
+  size_t static_size() const {
+    return m_static_size;
+  }
+
+  // expected output size, from the running average of past renders,
+  // at least the static text length
+  size_t estimate_size() const {
+    size_t avg = m_stats->avg_size.load(std::memory_order_relaxed);
+    return std::max(m_static_size, avg + avg / 8);
+  }
+
+  void render(const auto_data& data, OutputSink* out) const {
+    m_program->run(Context(data, &m_options), out);
+  }
+
+  // renders with obj bound to name, obj is a struct registered with
+  // type_fields, a std::vector of them, or any value type_of accepts:
+  //   templ.render("person", person) for {$person.name}
+  template <class T>
+  std::string render(std::string_view name, const T& obj) const {
+    std::string str;
+    StringSink out(&str);
+    render(name, obj, &out);
+    return str;
+  }
+
+  template <class T>
+  void render(std::string_view name, const T& obj, OutputSink* out) const {
+    Context root(auto_data::null_value(), &m_options);
+    m_program->run(Context(&root, name, value_ref::of(obj)), out);
+  }
+
+  // token tree, for tools that walk the template
+  const TokenList& tree() const {
+    return m_tree;
+  }
+
+  const Program& program() const {
+    return *m_program;
+  }
+
+ private:
+  struct Stats {
+    std::atomic<size_t> avg_size{0};
+  };
+
+  // exponential moving average, weight of the new sample is 1/8
+  void record_size(size_t size) const {
+    size_t avg = m_stats->avg_size.load(std::memory_order_relaxed);
+    if (avg == 0) {
+      avg = size;
+    } else {
+      avg = avg - avg / 8 + size / 8;
+    }
+    m_stats->avg_size.store(avg, std::memory_order_relaxed);
+  }
+
+  RenderOptions m_options;
+  // tokens point into m_text and live in m_pool, both are shared so
+  // copies of Template stay valid
+  std::shared_ptr<const std::string> m_text;
+  std::shared_ptr<TokenPool> m_pool;
+  std::shared_ptr<Stats> m_stats;
+  TokenList m_tree;
+  std::shared_ptr<const Program> m_program;
+  size_t m_static_size = 0;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// render_batch
+// one template, many data items
+//////////////////////////////////////////////////////////////////////////
+// renders items[i] into sink_factory(i) for every i, in index order.
+// Without a pool each item is rendered straight into its sink. With a
+// pool, items are rendered in windows into scratch buffers that are
+// reused for the whole batch, then written to their sinks in order by
+// the calling thread, so sinks need not be thread safe and may all be
+// the same sink.
+using SinkFactory = std::function<OutputSink*(size_t index)>;
+
+inline void render_batch(const Template& templ, const auto_data* items,
+                         size_t count, const SinkFactory& sink_factory,
+                         ThreadPool* pool = NULL) {
+  if (pool == NULL || pool->size() == 1) {
+    for (size_t i = 0; i < count; ++i) {
+      templ.render(items[i], sink_factory(i));
+    }
+    return;
+  }
+  std::vector<std::string> buffers(std::min<size_t>(count,
+                                                    pool->size() * 16));
+  for (size_t start = 0; start < count; start += buffers.size()) {
+    size_t size = std::min(buffers.size(), count - start);
+    pool->parallel_for(size, 1, [&](size_t i) {
+      buffers[i].clear();
+      templ.render_into(items[start + i], &buffers[i]);
+    });
+    for (size_t i = 0; i < size; ++i) {
+      sink_factory(start + i)->write(buffers[i].data(), buffers[i].size());
+    }
+  }
+}
+
+inline void render_batch(const Template& templ,
+                         const std::vector<auto_data>& items,
+                         const SinkFactory& sink_factory,
+                         ThreadPool* pool = NULL) {
+  render_batch(templ, items.data(), items.size(), sink_factory, pool);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// TemplateCache
+// compiled templates by file name under a root directory
+//////////////////////////////////////////////////////////////////////////
+// a template is read and compiled on its first get. With reload_ms >= 0
+// get also checks the file's modification time, at most once per
+// reload_ms for each template, and recompiles it when it changed.
+// Lookups only take a shared lock and compiling is done without any
+// lock, so readers never wait for a reload; a render keeps the
+// Template it got alive even if it is replaced meanwhile.
+class TemplateCache {
+ public:
+  explicit TemplateCache(std::string root, int reload_ms = -1,
+                         const RenderOptions& options = RenderOptions())
+      : m_root(std::move(root)), m_reload_ms(reload_ms), m_options(options) {
+    if (!m_root.empty() && m_root.back() != '/') {
+      m_root += '/';
+    }
+  }
+
+  TemplateCache(const TemplateCache&) = delete;
+  TemplateCache& operator=(const TemplateCache&) = delete;
+
+  // throws TemplateException when the file can not be read or compiled
+  std::shared_ptr<const Template> get(std::string_view name) {
+    {
+      std::shared_lock<std::shared_mutex> lock(m_mutex);
+      auto it = m_entries.find(name);
+      if (it != m_entries.end()) {
+        Entry* entry = it->second.get();
+        if (!due(entry)) {
+          return entry->templ;
+        }
+        std::shared_ptr<const Template> templ = entry->templ;
+        int64_t mtime = entry->mtime;
+        lock.unlock();
+        return reload(name, templ, mtime);
+      }
+    }
+    return reload(name, NULL, 0);
+  }
+
+  std::string render(std::string_view name, const auto_data& data) {
+    return get(name)->render(data);
+  }
+
+  // returns the template rendered, a sink keeping pointers to its text
+  // (IovecSink) is valid only while that is held, across a reload too
+  std::shared_ptr<const Template> render(std::string_view name,
+                                         const auto_data& data,
+                                         OutputSink* out) {
+    std::shared_ptr<const Template> templ = get(name);
+    templ->render(data, out);
+    return templ;
+  }
+
+  // drops all compiled templates, they are loaded again on next get
+  void clear() {
+    std::unique_lock<std::shared_mutex> lock(m_mutex);
+    m_entries.clear();
+  }
+
+  size_t size() const {
+    std::shared_lock<std::shared_mutex> lock(m_mutex);
+    return m_entries.size();
+  }
+
+ private:
+  struct Entry {
+    std::shared_ptr<const Template> templ;
+    int64_t mtime = 0;
+    // steady clock ns of the next modification check
+    std::atomic<int64_t> next_check{0};
+  };
+
+  static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // true for the one caller that should check the file now
+  bool due(Entry* entry) const {
+    if (m_reload_ms < 0) {
+      return false;
+    }
+    int64_t now = now_ns();
+    int64_t next = entry->next_check.load(std::memory_order_relaxed);
+    if (now < next) {
+      return false;
+    }
+    return entry->next_check.compare_exchange_strong(
+        next, now + static_cast<int64_t>(m_reload_ms) * 1000000,
+        std::memory_order_relaxed);
+  }
+
+  std::string path(std::string_view name) const {
+    if (name.empty() || name.front() == '/' ||
+        name.find("..") != std::string_view::npos) {
+      throw TemplateException("invalid template name: " + std::string(name));
+    }
+    return m_root + std::string(name);
+  }
+
+  // modification time in ns, -1 if the file is missing
+  static int64_t file_mtime(const std::string& file) {
+    struct stat st;
+    if (stat(file.c_str(), &st) != 0) {
+      return -1;
+    }
+#if defined(__APPLE__)
+    return st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#elif defined(__unix__)
+    return st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#else
+    return st.st_mtime * 1000000000LL;
+#endif
+  }
+
+  static std::string read_file(const std::string& file) {
+    FILE* f = fopen(file.c_str(), "rb");
+    if (f == NULL) {
+      throw TemplateException("can not open template: " + file);
+    }
+    std::string text;
+    char buf[8192];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+      text.append(buf, n);
+    }
+    fclose(f);
+    return text;
+  }
+
+  // compiles the file unless its mtime is still mtime, then publishes it
+  std::shared_ptr<const Template> reload(
+      std::string_view name, std::shared_ptr<const Template> current,
+      int64_t mtime) {
+    std::string file = path(name);
+    int64_t now = file_mtime(file);
+    if (current && (now == mtime || now < 0)) {
+      // unchanged, or deleted: keep serving what we have
+      return current;
+    }
+    auto templ = std::make_shared<const Template>(read_file(file), m_options);
+
+    std::unique_lock<std::shared_mutex> lock(m_mutex);
+    auto it = m_entries.find(name);
+    if (it == m_entries.end()) {
+      it = m_entries.emplace(std::string(name),
+                             std::make_unique<Entry>()).first;
+    } else if (!current || it->second->mtime > now) {
+      // another thread loaded the same or a newer version first
+      return it->second->templ;
+    }
+    Entry* entry = it->second.get();
+    entry->templ = templ;
+    entry->mtime = now;
+    if (m_reload_ms >= 0) {
+      entry->next_check.store(
+          now_ns() + static_cast<int64_t>(m_reload_ms) * 1000000,
+          std::memory_order_relaxed);
+    }
+    return templ;
+  }
+
+  std::string m_root;
+  int m_reload_ms;
+  RenderOptions m_options;
+  mutable std::shared_mutex m_mutex;
+  // std::less<> allows lookup by string_view
+  std::map<std::string, std::unique_ptr<Entry>, std::less<>> m_entries;
+};
+
+#ifdef CPPTEMPL_CT_TEMPLATE
+//////////////////////////////////////////////////////////////////////////
+// ct_template
+// a template given as a string literal template argument, tokenized by
+// the compiler into a fixed sequence of writes and lookups:
+//   cpptempl::ct_template<"name:{$name}, age:{$age}">::render(data)
+// Only text and variables are supported, {% %} blocks fail to compile.
+//////////////////////////////////////////////////////////////////////////
+template <size_t N>
+struct fixed_string {
+  char data[N] = {};
+  constexpr fixed_string(const char (&str)[N]) {  // NOLINT
+    for (size_t i = 0; i < N; ++i) {
+      data[i] = str[i];
+    }
+  }
+  constexpr std::string_view view() const {
+    return std::string_view(data, N - 1);
+  }
+};
+
+namespace ct {
+
+enum PartKind : uint8_t {
+  PART_TEXT,    // write text
+  PART_ROOT,    // item = first segment of a variable in data
+  PART_MEMBER,  // item = next segment of item
+  PART_VALUE,   // write item
+};
+
+// text is a slice of the template: [pos, pos + size)
+struct Part {
+  PartKind kind;
+  size_t pos;
+  size_t size;
+};
+
+// a template has fewer parts than N, its size with the '\0'
+template <size_t N>
+struct Parts {
+  Part parts[N] = {};
+  size_t size = 0;
+
+  // adjacent text is merged into one part
+  constexpr void add(PartKind kind, size_t pos, size_t size) {
+    if (kind == PART_TEXT && this->size > 0) {
+      Part& last = parts[this->size - 1];
+      if (last.kind == PART_TEXT && last.pos + last.size == pos) {
+        last.size += size;
+        return;
+      }
+    }
+    parts[this->size++] = Part{kind, pos, size};
+  }
+};
+
+// string_view::find is not a constant expression in gcc builds with
+// -fsanitize, so split searches by hand
+constexpr size_t find(std::string_view text, char c, size_t pos) {
+  for (; pos < text.size(); ++pos) {
+    if (text[pos] == c) {
+      return pos;
+    }
+  }
+  return std::string_view::npos;
+}
+
+constexpr size_t rfind(std::string_view text, char c) {
+  for (size_t pos = text.size(); pos > 0; --pos) {
+    if (text[pos - 1] == c) {
+      return pos - 1;
+    }
+  }
+  return std::string_view::npos;
+}
+
+// same rules as Parser::tokenize for text and variables
+template <size_t N>
+constexpr Parts<N> split(std::string_view text) {
+  Parts<N> parts;
+  size_t pos = 0;
+  while (pos < text.size()) {
+    size_t open = find(text, '{', pos);
+    if (open == std::string_view::npos) {
+      parts.add(PART_TEXT, pos, text.size() - pos);
+      break;
+    }
+    if (open > pos) {
+      parts.add(PART_TEXT, pos, open - pos);
+    }
+    pos = open + 1;
+    if (pos == text.size()) {
+      parts.add(PART_TEXT, open, 1);
+      break;
+    }
+    if (text[pos] == '$') {
+      size_t close = find(text, '}', pos);
+      if (close == std::string_view::npos) {
+        continue;
+      }
+      std::string_view key = text.substr(pos + 1, close - pos - 1);
+      if (!key.empty() && key[0] == '\"') {
+        // quoted string, written as text
+        size_t index = rfind(key.substr(1), '\"');
+        if (index != std::string_view::npos && index > 0) {
+          parts.add(PART_TEXT, pos + 2, index);
+        }
+      } else {
+        size_t start = pos + 1;
+        PartKind kind = PART_ROOT;
+        while (true) {
+          size_t dot = find(text, '.', start);
+          if (dot == std::string_view::npos || dot > close) {
+            parts.add(kind, start, close - start);
+            break;
+          }
+          parts.add(kind, start, dot - start);
+          kind = PART_MEMBER;
+          start = dot + 1;
+        }
+        parts.add(PART_VALUE, 0, 0);
+      }
+      pos = close + 1;
+    } else if (text[pos] == '%') {
+      throw TemplateException("ct_template supports text and variables only");
+    } else {
+      parts.add(PART_TEXT, open, 1);
+    }
+  }
+  return parts;
+}
+
+}  // namespace ct
+
+template <fixed_string Text>
+class ct_template {
+ public:
+  static void render(const auto_data& data, OutputSink* out,
+                     const RenderOptions& options = RenderOptions()) {
+    Context ctx(data, &options);
+    const auto_data* item = NULL;
+    render(ctx, data, out, options, &item,
+           std::make_index_sequence<kParts.size>());
+  }
+
+  static std::string render(const auto_data& data) {
+    std::string str;
+    str.reserve(static_size());
+    StringSink out(&str);
+    render(data, &out);
+    return str;
+  }
+
+  // total length of static text in the template
+  static constexpr size_t static_size() {
+    size_t size = 0;
+    for (size_t i = 0; i < kParts.size; ++i) {
+      if (kParts.parts[i].kind == ct::PART_TEXT) {
+        size += kParts.parts[i].size;
+      }
+    }
+    return size;
+  }
+
+ private:
+  static constexpr auto kParts = ct::split<sizeof(Text.data)>(Text.view());
+
+  template <size_t... I>
+  static void render(const Context& ctx, const auto_data& data,
+                     OutputSink* out, const RenderOptions& options,
+                     const auto_data** item, std::index_sequence<I...>) {
+    (render_part<I>(ctx, data, out, options, item), ...);
+  }
+
+  // one part, chosen while compiling
+  template <size_t I>
+  static void render_part(const Context& ctx, const auto_data& data,
+                          OutputSink* out, const RenderOptions& options,
+                          const auto_data** item) {
+    constexpr ct::Part part = kParts.parts[I];
+    constexpr std::string_view text = Text.view().substr(part.pos, part.size);
+    if constexpr (part.kind == ct::PART_TEXT) {
+      out->write_static(text.data(), text.size());
+    } else if constexpr (part.kind == ct::PART_ROOT) {
+      *item = lookup(ctx, &data, text);
+    } else if constexpr (part.kind == ct::PART_MEMBER) {
+      *item = lookup(ctx, *item, text);
+    } else {
+      write_value(**item, out, options);
+    }
+  }
+};
+#endif  // CPPTEMPL_CT_TEMPLATE
+
+inline std::string parse(std::string_view templ_text, const auto_data& data) {
     return Parser::parse(templ_text, data);
 }
 
+inline void parse(std::string_view templ_text, const auto_data& data,
+                  OutputSink* out) {
+    Parser::parse(templ_text, data, out);
+}
+
 }  // namespace cpptempl
 
 #endif  // CPPTEMPL_H_
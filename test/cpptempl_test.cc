@@ -14,8 +14,47 @@
 #define CATCH_CONFIG_MAIN
 
 #include <time.h>
+#include <signal.h>
+#include <chrono>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
 #include "catch.hpp"
 #include "../src/cpptempl.h"
+#include "templates/lazy.tmpl.h"
+#include "templates/notify.tmpl.h"
+
+// count heap allocations, to check render paths that shouldn't allocate
+static std::atomic<size_t> g_alloc_count(0);
+void* operator new(size_t size) {
+  g_alloc_count++;
+  void* p = malloc(size == 0 ? 1 : size);
+  if (p == NULL) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+void operator delete(void* p) noexcept {
+  free(p);
+}
+void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+void* operator new(size_t size, std::align_val_t align) {
+  g_alloc_count++;
+  size_t a = static_cast<size_t>(align);
+  void* p = aligned_alloc(a, (size + a - 1) / a * a);
+  if (p == NULL) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+void operator delete(void* p, std::align_val_t) noexcept {
+  free(p);
+}
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+  free(p);
+}
 
 TEST_CASE("cpptempl1", "nomal object") {
   // test nomal obj
@@ -48,7 +87,7 @@ TEST_CASE("cpptempl2", "object") {
 
 TEST_CASE("cpptempl3", "nomal object") {
   // 差不多1秒10w次
-  uint32_t start = time(NULL);
+  auto start = std::chrono::steady_clock::now();
   for (int i = 0; i < 100000; i++) {
     cpptempl::auto_data data;
     data["age"] = 10;
@@ -56,8 +95,36 @@ TEST_CASE("cpptempl3", "nomal object") {
     std::string str = "name:{$name}, age:{$age}";
     cpptempl::parse(str, data);
   }
-  uint32_t end = time(NULL);
-  printf("speed:%us for 10w \n", (end-start));
+  auto end = std::chrono::steady_clock::now();
+  printf("speed:%.2fms for 10w \n",
+         std::chrono::duration<double, std::milli>(end-start).count());
+
+  // compiled once, render many times
+  start = std::chrono::steady_clock::now();
+  cpptempl::Template templ("name:{$name}, age:{$age}");
+  for (int i = 0; i < 100000; i++) {
+    cpptempl::auto_data data;
+    data["age"] = 10;
+    data["name"] = "xu";
+    templ.render(data);
+  }
+  end = std::chrono::steady_clock::now();
+  printf("compiled speed:%.2fms for 10w \n",
+         std::chrono::duration<double, std::milli>(end-start).count());
+
+#ifdef CPPTEMPL_CT_TEMPLATE
+  // tokenized while compiling
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < 100000; i++) {
+    cpptempl::auto_data data;
+    data["age"] = 10;
+    data["name"] = "xu";
+    cpptempl::ct_template<"name:{$name}, age:{$age}">::render(data);
+  }
+  end = std::chrono::steady_clock::now();
+  printf("compile-time speed:%.2fms for 10w \n",
+         std::chrono::duration<double, std::milli>(end-start).count());
+#endif
 }
 
 TEST_CASE("cpptempl4", "if block") {
@@ -129,3 +196,1196 @@ TEST_CASE("cpptempl5", "for block") {
   ret = cpptempl::parse(str, data2);
   REQUIRE(ret == "name:xu name:car ");
 }
+
+TEST_CASE("cpptempl6", "compiled template") {
+  cpptempl::Template templ("name:{$name}, age:{$age}");
+  cpptempl::auto_data data1;
+  data1["age"] = 10;
+  data1["name"] = "xu";
+  REQUIRE(templ.render(data1) == "name:xu, age:10");
+
+  cpptempl::auto_data data2;
+  data2["age"] = 11;
+  data2["name"] = "sails";
+  REQUIRE(templ.render(data2) == "name:sails, age:11");
+  REQUIRE(templ.render(data1) == "name:xu, age:10");
+}
+
+TEST_CASE("cpptempl7", "tokenize") {
+  cpptempl::auto_data data;
+  data["name"] = "xu";
+  REQUIRE(cpptempl::parse("a{b}{$name}", data) == "a{b}xu");
+  REQUIRE(cpptempl::parse("{$name}{", data) == "xu{");
+  REQUIRE(cpptempl::parse("{%  if name  %}{$name}{%endif%}", data) == "xu");
+
+  // large template, tokens are slices of the template text
+  std::string str;
+  std::string expect;
+  for (int i = 0; i < 10000; i++) {
+    str += "<p>{$name}</p>";
+    expect += "<p>xu</p>";
+  }
+  cpptempl::Template templ(str);
+  REQUIRE(templ.render(data) == expect);
+}
+
+TEST_CASE("cpptempl8", "unbalanced block") {
+  cpptempl::auto_data data;
+  REQUIRE_THROWS_AS(cpptempl::parse("{% endfor %}", data),
+                    cpptempl::TemplateException);
+  REQUIRE_THROWS_AS(cpptempl::parse("{%if a%}{% endfor %}", data),
+                    cpptempl::TemplateException);
+  REQUIRE_THROWS_AS(cpptempl::parse("{%for a in b%}", data),
+                    cpptempl::TemplateException);
+  REQUIRE_THROWS_AS(cpptempl::parse("{%for a b%}{%endfor%}", data),
+                    cpptempl::TemplateException);
+  // statements are told apart by their first word
+  data["l"].push_back(1);
+  REQUIRE_THROWS_AS(cpptempl::parse("{%foreach x in l%}{%endfor%}", data),
+                    cpptempl::TemplateException);
+  REQUIRE_THROWS_AS(cpptempl::parse("{%rows x in l%}{%endfor%}", data),
+                    cpptempl::TemplateException);
+  REQUIRE_THROWS_AS(cpptempl::parse("{%iffy l%}{%endif%}", data),
+                    cpptempl::TemplateException);
+  REQUIRE_THROWS_AS(cpptempl::TokenFor("only x in l"),
+                    cpptempl::TemplateException);
+  REQUIRE(cpptempl::parse("{%if(l)%}y{%endif%}", data) == "y");
+
+  // deep nesting doesn't recurse in parse_tree or when tokens are freed
+  std::string str;
+  for (int i = 0; i < 100000; i++) {
+    str += "{%if a%}";
+  }
+  for (int i = 0; i < 100000; i++) {
+    str += "{%endif%}";
+  }
+  cpptempl::Template templ(str);
+}
+
+TEST_CASE("cpptempl9", "parse_tree scaling") {
+  // compile time should grow linearly with the number of tokens
+  double last = 0;
+  for (int n = 10000; n <= 100000; n *= 10) {
+    std::string str;
+    for (int i = 0; i < n / 4; i++) {
+      str += "{%if a%}x{$b}{%endif%}";
+    }
+    auto start = std::chrono::steady_clock::now();
+    cpptempl::Template* templ = new cpptempl::Template(str);
+    auto end = std::chrono::steady_clock::now();
+    double ms = std::chrono::duration<double, std::milli>(end-start).count();
+    printf("compile %d tokens:%.2fms", n, ms);
+    if (last > 0) {
+      printf(" (x%.1f)", ms / last);
+    }
+    last = ms;
+    start = std::chrono::steady_clock::now();
+    delete templ;
+    end = std::chrono::steady_clock::now();
+    printf(", destroy:%.2fms\n",
+           std::chrono::duration<double, std::milli>(end-start).count());
+  }
+}
+
+TEST_CASE("cpptempl10", "output sink") {
+  cpptempl::auto_data data;
+  data["name"] = "xu";
+  data["list"].push_back(1);
+  data["list"].push_back(2);
+  cpptempl::Template templ("name:{$name}{%for i in list%} {$i}{%endfor%}");
+
+  std::string str = "ret:";
+  cpptempl::StringSink string_sink(&str);
+  templ.render(data, &string_sink);
+  REQUIRE(str == "ret:name:xu 1 2");
+
+  std::ostringstream os;
+  cpptempl::StreamSink stream_sink(&os);
+  templ.render(data, &stream_sink);
+  REQUIRE(os.str() == "name:xu 1 2");
+
+  std::string pieces;
+  int count = 0;
+  cpptempl::CallbackSink callback_sink([&](const char* p, size_t size) {
+    pieces.append(p, size);
+    count++;
+  });
+  cpptempl::parse("name:{$name}", data, &callback_sink);
+  REQUIRE(pieces == "name:xu");
+  REQUIRE(count == 2);
+
+  // failed writes are reported, not dropped silently
+  int fds[2];
+  REQUIRE(pipe(fds) == 0);
+  cpptempl::FdSink fd_sink(fds[1]);
+  templ.render(data, &fd_sink);
+  REQUIRE(fd_sink.error() == 0);
+  char buf[64];
+  REQUIRE(read(fds[0], buf, sizeof(buf)) == 11);
+  close(fds[0]);
+  signal(SIGPIPE, SIG_IGN);
+  templ.render(data, &fd_sink);
+  REQUIRE(fd_sink.error() == EPIPE);
+  close(fds[1]);
+
+  FILE* full = fopen("/dev/full", "wb");
+  if (full != NULL) {
+    setvbuf(full, NULL, _IONBF, 0);
+    cpptempl::FileSink file_sink(full);
+    templ.render(data, &file_sink);
+    REQUIRE(file_sink.error() == ENOSPC);
+    fclose(full);
+  }
+}
+
+TEST_CASE("cpptempl11", "output size prediction") {
+  cpptempl::Template templ("<p>name:{$name}</p>");
+  REQUIRE(templ.static_size() == 12);
+  REQUIRE(templ.estimate_size() == 12);
+
+  cpptempl::auto_data data;
+  data["name"] = std::string(1000, 'x');
+  std::string str;
+  templ.render_into(data, &str);
+  REQUIRE(str.size() == 1012);
+  REQUIRE(templ.estimate_size() >= 1012);
+
+  // reserved once from the estimate, no realloc while rendering
+  std::string str2;
+  size_t estimate = templ.estimate_size();
+  size_t count = g_alloc_count;
+  templ.render_into(data, &str2);
+  size_t allocs = g_alloc_count - count;
+  REQUIRE(allocs == 1);
+  REQUIRE(str2.capacity() >= estimate);
+  REQUIRE(str2 == str);
+}
+
+TEST_CASE("cpptempl12", "precompiled path") {
+  cpptempl::VarPath path("a.b.c");
+  REQUIRE(path.segments().size() == 3);
+  REQUIRE(path.segments()[2] == "c");
+  cpptempl::VarPath literal("\"a.b\"");
+  REQUIRE(literal.is_literal());
+  REQUIRE(literal.literal().str() == "a.b");
+
+  cpptempl::auto_data data;
+  data["a"]["b"]["c"] = "abc";
+  std::string_view key = "a";
+  REQUIRE(data.has(key));
+  REQUIRE(cpptempl::parse("{$a.b.c}{$a.x.c}", data) == "abc");
+  REQUIRE(cpptempl::parse("{%if a.b.c == \"abc\"%}ok{%endif%}", data) == "ok");
+}
+
+TEST_CASE("cpptempl13", "lookup by reference") {
+  cpptempl::auto_data data;
+  data["name"] = std::string(100, 'x');
+  data["age"] = 10;
+  data["p"]["name"] = std::string(100, 'y');
+  cpptempl::VarPath path("p.name");
+  REQUIRE(cpptempl::lookup(path, data) == &data["p"]["name"]);
+  cpptempl::VarPath missing("p.x");
+  REQUIRE(cpptempl::lookup(missing, data) ==
+          &cpptempl::auto_data::null_value());
+
+  cpptempl::Template templ("{$name} {$age} {$p.name} {$p.x}"
+                           "{%if p.name == p.name%}ok{%endif%}");
+  std::string str;
+  str.reserve(1024);
+  cpptempl::StringSink out(&str);
+  size_t count = g_alloc_count;
+  templ.render(data, &out);
+  size_t allocs = g_alloc_count - count;
+  REQUIRE(allocs == 0);
+  REQUIRE(str.size() == 100 + 1 + 2 + 1 + 100 + 1 + 2);
+}
+
+TEST_CASE("cpptempl14", "if expression") {
+  cpptempl::auto_data data;
+  data["age"] = 10;
+  data["price"] = 2.5;
+  data["name"] = "xu";
+  data["ok"] = true;
+  REQUIRE(cpptempl::parse("{%if age != 11%}a{%endif%}", data) == "a");
+  REQUIRE(cpptempl::parse("{%if age < 11%}a{%endif%}", data) == "a");
+  REQUIRE(cpptempl::parse("{%if age <= 10%}a{%endif%}", data) == "a");
+  REQUIRE(cpptempl::parse("{%if age > 10%}a{%endif%}", data) == "");
+  REQUIRE(cpptempl::parse("{%if age >= 10%}a{%endif%}", data) == "a");
+  REQUIRE(cpptempl::parse("{%if price > 2%}a{%endif%}", data) == "a");
+  REQUIRE(cpptempl::parse("{%if price == 2.5%}a{%endif%}", data) == "a");
+  REQUIRE(cpptempl::parse("{%if age == 10.0%}a{%endif%}", data) == "a");
+  REQUIRE(cpptempl::parse("{%if age>-1%}a{%endif%}", data) == "a");
+  REQUIRE(cpptempl::parse("{%if name < \"z y\"%}a{%endif%}", data) == "a");
+  REQUIRE(cpptempl::parse("{%if ok and age == 10%}a{%endif%}", data) == "a");
+  REQUIRE(cpptempl::parse("{%if not ok or missing%}a{%endif%}", data) == "");
+  REQUIRE(cpptempl::parse(
+      "{%if not (age < 5 or name == \"x\") and (ok)%}a{%endif%}",
+      data) == "a");
+  REQUIRE(cpptempl::parse("{%if ok == (age == 10)%}a{%endif%}", data) == "a");
+
+  REQUIRE_THROWS_AS(cpptempl::parse("{%if%}a{%endif%}", data),
+                    cpptempl::TemplateException);
+  REQUIRE_THROWS_AS(cpptempl::parse("{%if (ok%}a{%endif%}", data),
+                    cpptempl::TemplateException);
+  REQUIRE_THROWS_AS(cpptempl::parse("{%if ok =< 1%}a{%endif%}", data),
+                    cpptempl::TemplateException);
+  REQUIRE_THROWS_AS(cpptempl::parse("{%if ok age%}a{%endif%}", data),
+                    cpptempl::TemplateException);
+  REQUIRE_THROWS_AS(cpptempl::parse("{%if age == 10abc%}a{%endif%}", data),
+                    cpptempl::TemplateException);
+  REQUIRE_THROWS_AS(cpptempl::parse("{%if 2fa%}a{%endif%}", data),
+                    cpptempl::TemplateException);
+  REQUIRE_THROWS_AS(cpptempl::parse("{%if price > 2.5.1%}a{%endif%}", data),
+                    cpptempl::TemplateException);
+  REQUIRE_THROWS_AS(
+      cpptempl::parse("{%if age < 99999999999999999999%}a{%endif%}", data),
+      cpptempl::TemplateException);
+  REQUIRE(cpptempl::parse("{%if price < 1e3%}a{%endif%}", data) == "a");
+}
+
+TEST_CASE("cpptempl15", "for scope") {
+  cpptempl::auto_data data;
+  data["title"] = "t";
+  cpptempl::auto_data p1;
+  p1["name"] = "xu";
+  p1["tags"].push_back("a");
+  p1["tags"].push_back("b");
+  cpptempl::auto_data p2;
+  p2["name"] = "car";
+  p2["tags"].push_back("c");
+  data["people"]["list"].push_back(p1);
+  data["people"]["list"].push_back(p2);
+  std::string str = "{%for p in people.list%}{$title}:{$p.name}"
+                    "{%for tag in p.tags%} {$tag}/{$p.name}{%endfor%};"
+                    "{%endfor%}";
+  cpptempl::Template templ(str);
+  REQUIRE(templ.render(data) == "t:xu a/xu b/xu;t:car c/car;");
+
+  // loop variable hides outer variable of the same name
+  REQUIRE(cpptempl::parse("{%for title in people.list%}{$title.name}"
+                          "{%endfor%}{$title}", data) == "xucart");
+
+  // iterations don't allocate
+  std::string ret;
+  ret.reserve(1024);
+  cpptempl::StringSink out(&ret);
+  size_t count = g_alloc_count;
+  templ.render(data, &out);
+  size_t allocs = g_alloc_count - count;
+  REQUIRE(allocs == 0);
+}
+
+TEST_CASE("cpptempl16", "compact auto_data") {
+  printf("sizeof(auto_data):%zu\n", sizeof(cpptempl::auto_data));
+  REQUIRE(sizeof(cpptempl::auto_data) == 16);
+
+  // inline and heap strings
+  std::string small(14, 's');
+  std::string large(15, 'l');
+  cpptempl::auto_data s = small;
+  cpptempl::auto_data l = large;
+  REQUIRE(std::string(s) == small);
+  REQUIRE(std::string(l) == large);
+  size_t count = g_alloc_count;
+  cpptempl::auto_data s2 = s;
+  size_t allocs = g_alloc_count - count;
+  REQUIRE(allocs == 0);
+  cpptempl::auto_data l2 = l;
+  REQUIRE(l2.str() == l.str());
+  s2 = l2;
+  REQUIRE(s2.str() == large);
+  l2 = s;
+  REQUIRE(l2.str() == small);
+
+  // changing type frees the old payload
+  cpptempl::auto_data d = large;
+  d["key"] = 1;
+  REQUIRE(d.Type() == cpptempl::auto_data::data_type::map);
+  d.push_back(large);
+  REQUIRE(d.Type() == cpptempl::auto_data::data_type::list);
+  const cpptempl::auto_data& cd = d;
+  REQUIRE(cd.size() == 1);
+  REQUIRE(cd[0].str() == large);
+
+  auto start = std::chrono::steady_clock::now();
+  cpptempl::auto_data list;
+  for (int i = 0; i < 1000000; i++) {
+    list.push_back(i);
+  }
+  auto end = std::chrono::steady_clock::now();
+  printf("build 1M int list:%.2fms\n",
+         std::chrono::duration<double, std::milli>(end-start).count());
+  REQUIRE(list.size() == 1000000);
+}
+
+static cpptempl::auto_data build_row(int i) {
+  cpptempl::auto_data row;
+  row["id"] = i;
+  row["name"] = std::string(32, 'n');
+  row["email"] = std::string(32, 'e');
+  return row;
+}
+
+TEST_CASE("cpptempl17", "move auto_data") {
+  cpptempl::auto_data big = build_row(1);
+  size_t count = g_alloc_count;
+  cpptempl::auto_data moved = std::move(big);
+  size_t allocs = g_alloc_count - count;
+  REQUIRE(allocs == 0);
+  REQUIRE(big.empty());
+  REQUIRE(moved.Get("id").Type() ==
+          cpptempl::auto_data::data_type::number_integer);
+
+  cpptempl::auto_data data;
+  count = g_alloc_count;
+  data["x"] = std::move(moved);
+  allocs = g_alloc_count - count;
+  // only the map and its node for x
+  REQUIRE(allocs == 2);
+
+  data.emplace("z", "zz");
+  data.emplace("z", "other");
+  REQUIRE(data.Get("z").str() == "zz");
+  data["list"].emplace_back(std::string(32, 'l'));
+  REQUIRE(data.Get("list")[0].str() == std::string(32, 'l'));
+
+  // 50k rows, copying vs moving into the list
+  for (int pass = 0; pass < 2; pass++) {
+    count = g_alloc_count;
+    auto start = std::chrono::steady_clock::now();
+    cpptempl::auto_data rows;
+    for (int i = 0; i < 50000; i++) {
+      cpptempl::auto_data row = build_row(i);
+      if (pass == 0) {
+        rows.push_back(row);
+      } else {
+        rows.push_back(std::move(row));
+      }
+    }
+    auto end = std::chrono::steady_clock::now();
+    printf("%s 50k rows:%zu allocations, %.2fms\n",
+           pass == 0 ? "copy" : "move", g_alloc_count - count,
+           std::chrono::duration<double, std::milli>(end-start).count());
+  }
+}
+
+// 10k nodes: 2000 rows of a map with 4 fields
+static cpptempl::auto_data build_model() {
+  cpptempl::auto_data model;
+  for (int i = 0; i < 2000; i++) {
+    cpptempl::auto_data row;
+    row["id"] = i;
+    row["name"] = "name of the row";
+    row["email"] = "someone@example.com";
+    model["rows"].push_back(std::move(row));
+  }
+  return model;
+}
+
+TEST_CASE("cpptempl18", "arena data model") {
+  cpptempl::Template templ("{%for r in rows%}{$r.id}:{$r.email};{%endfor%}");
+  std::string expect = templ.render(build_model());
+
+  for (int pass = 0; pass < 2; pass++) {
+    size_t count = g_alloc_count;
+    auto start = std::chrono::steady_clock::now();
+    for (int n = 0; n < 20; n++) {
+      if (pass == 0) {
+        cpptempl::auto_data model = build_model();
+      } else {
+        std::pmr::monotonic_buffer_resource arena(1 << 20);
+        cpptempl::ArenaScope scope(&arena);
+        cpptempl::auto_data model = build_model();
+      }  // with arena: model is torn down, then arena frees its buffers
+    }
+    auto end = std::chrono::steady_clock::now();
+    printf("%s 10k node model x20:%zu allocations, %.2fms\n",
+           pass == 0 ? "heap" : "arena", g_alloc_count - count,
+           std::chrono::duration<double, std::milli>(end-start).count());
+  }
+  {
+    std::pmr::monotonic_buffer_resource arena(1 << 20);
+    cpptempl::ArenaScope scope(&arena);
+    cpptempl::auto_data model = build_model();
+    REQUIRE(templ.render(model) == expect);
+  }
+
+  // copies made after the scope ends use the heap again
+  std::pmr::monotonic_buffer_resource arena;
+  cpptempl::auto_data inside;
+  {
+    cpptempl::ArenaScope scope(&arena);
+    inside["key"] = "a string longer than 14 bytes";
+  }
+  REQUIRE(cpptempl::auto_data::resource() == std::pmr::get_default_resource());
+  cpptempl::auto_data outside = inside;
+  REQUIRE(outside.Get("key").str() == "a string longer than 14 bytes");
+
+  // a template compiled inside a scope keeps its literals on the heap
+  char buf[4096];
+  cpptempl::Template* compiled;
+  {
+    std::pmr::monotonic_buffer_resource small(buf, sizeof(buf),
+                                              std::pmr::null_memory_resource());
+    cpptempl::ArenaScope scope(&small);
+    compiled = new cpptempl::Template(
+        "{%if key == \"a string longer than 14 bytes\"%}same{%endif%}"
+        "{$\"another literal longer than 14\"}");
+  }
+  memset(buf, 0, sizeof(buf));
+  REQUIRE(compiled->render(outside) == "sameanother literal longer than 14");
+  delete compiled;
+}
+
+TEST_CASE("cpptempl19", "instruction stream") {
+  cpptempl::auto_data data = build_model();
+  data["title"] = "rows";
+  data["show"] = true;
+  std::string str = "<h1>{$title}</h1>{%if show%}<table>"
+                    "{%for r in rows%}<tr>{%if r.id > 10%}<td>{$r.id}</td>"
+                    "{%endif%}<td>{$r.name}</td><td>{$r.email}</td></tr>"
+                    "{%for c in r.tags%}{%endfor%}{%endfor%}</table>{%endif%}"
+                    "{%for r in missing%}x{%endfor%}end{";
+  cpptempl::Template templ(str);
+  REQUIRE(templ.render(data) == cpptempl::parse(str, data));
+  // "{" and the text before it are merged into one instruction
+  REQUIRE(templ.program().code().back().op == cpptempl::Program::OP_TEXT);
+  REQUIRE(templ.program().code().back().text.size == 4);
+
+  // deeper than the inline loop frames
+  cpptempl::auto_data nested;
+  nested["l"].push_back(1);
+  nested["l"].push_back(2);
+  std::string deep;
+  std::string expect;
+  for (int i = 0; i < 12; i++) {
+    deep += "{%for a" + std::to_string(i) + " in l%}";
+  }
+  deep += "{$a0}{$a11}";
+  for (int i = 0; i < 12; i++) {
+    deep += "{%endfor%}";
+  }
+  cpptempl::Template deep_templ(deep);
+  REQUIRE(deep_templ.render(nested) == cpptempl::parse(deep, nested));
+  REQUIRE(deep_templ.render(nested).size() == 2 * 4096);
+
+  // instruction stream vs virtual tree walk
+  for (int pass = 0; pass < 2; pass++) {
+    std::string ret;
+    ret.reserve(1 << 20);
+    cpptempl::StringSink out(&ret);
+    auto start = std::chrono::steady_clock::now();
+    for (int n = 0; n < 20; n++) {
+      ret.clear();
+      if (pass == 0) {
+        cpptempl::Context ctx(data);
+        for (cpptempl::Token* token : templ.tree()) {
+          token->render(ctx, &out);
+        }
+      } else {
+        templ.render(data, &out);
+      }
+    }
+    auto end = std::chrono::steady_clock::now();
+    printf("%s x20:%.2fms\n", pass == 0 ? "tree walk" : "program",
+           std::chrono::duration<double, std::milli>(end-start).count());
+  }
+}
+
+TEST_CASE("cpptempl20", "delimiter scan") {
+  // every level finds the same delimiters, including the unaligned tail
+  std::string text;
+  for (int i = 0; i < 1000; i++) {
+    text += static_cast<char>("ab{}$% \n"[(i * 7 + i / 3) % 8]);
+  }
+  std::vector<size_t> expect;
+  cpptempl::scan_delimiters(text, &expect, cpptempl::SIMD_NONE);
+  REQUIRE(!expect.empty());
+  for (int level = cpptempl::SIMD_SSE2; level <= cpptempl::simd_level();
+       level++) {
+    std::vector<size_t> positions;
+    cpptempl::scan_delimiters(text, &positions,
+                              static_cast<cpptempl::SimdLevel>(level));
+    REQUIRE(positions == expect);
+  }
+
+  // mostly static newsletter html
+  std::string html;
+  while (html.size() < (8 << 20)) {
+    html += "<tr><td class=\"item\" style=\"padding:4px 8px;color:#333\">"
+            "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do "
+            "eiusmod tempor incididunt ut labore et dolore magna aliqua."
+            "</td><td>{$name}</td></tr>\n";
+  }
+  const char* names[] = {"scalar", "sse2", "avx2"};
+  for (int level = cpptempl::SIMD_NONE; level <= cpptempl::simd_level();
+       level++) {
+    std::vector<size_t> positions;
+    positions.reserve(html.size() / 64);
+    auto start = std::chrono::steady_clock::now();
+    for (int n = 0; n < 10; n++) {
+      positions.clear();
+      cpptempl::scan_delimiters(html, &positions,
+                                static_cast<cpptempl::SimdLevel>(level));
+    }
+    auto end = std::chrono::steady_clock::now();
+    double sec = std::chrono::duration<double>(end-start).count();
+    printf("scan %s:%.2fGB/s\n", names[level], html.size() * 10 / sec / 1e9);
+  }
+  auto start = std::chrono::steady_clock::now();
+  cpptempl::Template templ(html);
+  auto end = std::chrono::steady_clock::now();
+  double sec = std::chrono::duration<double>(end-start).count();
+  printf("compile:%.2fGB/s\n", html.size() / sec / 1e9);
+}
+
+TEST_CASE("cpptempl21", "number formatting") {
+  cpptempl::auto_data data;
+  data["big"] = static_cast<int64_t>(12345678901234LL);
+  data["neg"] = -42;
+  data["min"] = INT64_MIN;
+  data["zero"] = 0;
+  data["half"] = 2.5;
+  data["tenth"] = 0.1;
+  REQUIRE(cpptempl::parse("{$big} {$neg} {$min} {$zero}", data) ==
+          "12345678901234 -42 -9223372036854775808 0");
+  REQUIRE(cpptempl::parse("{$half} {$tenth}", data) == "2.5 0.1");
+
+  cpptempl::RenderOptions options;
+  options.float_precision = 2;
+  cpptempl::Template templ("{$half} {$tenth} {$big}", options);
+  REQUIRE(templ.render(data) == "2.50 0.10 12345678901234");
+
+  // formatter against snprintf
+  const int count = 1000000;
+  char buf[cpptempl::kFloatBufferSize];
+  size_t total = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < count; i++) {
+    total += snprintf(buf, sizeof(buf), "%" PRId64,
+                      static_cast<int64_t>(i * 7919LL));
+    total += snprintf(buf, sizeof(buf), "%.17g", i * 0.37);
+  }
+  auto mid = std::chrono::steady_clock::now();
+  for (int i = 0; i < count; i++) {
+    char* p = cpptempl::format_int(i * 7919LL, buf);
+    total += buf + cpptempl::kIntBufferSize - p;
+    total += cpptempl::format_float(i * 0.37, -1, buf);
+  }
+  auto end = std::chrono::steady_clock::now();
+  REQUIRE(total > 0);
+  printf("format 1M ints+doubles snprintf:%.2fms cpptempl:%.2fms\n",
+         std::chrono::duration<double, std::milli>(mid-start).count(),
+         std::chrono::duration<double, std::milli>(end-mid).count());
+}
+
+static void write_file(const std::string& file, const std::string& text) {
+  FILE* f = fopen(file.c_str(), "wb");
+  REQUIRE(f != NULL);
+  fwrite(text.data(), 1, text.size(), f);
+  fclose(f);
+}
+
+TEST_CASE("cpptempl22", "template cache") {
+  char root[] = "/tmp/cpptempl_XXXXXX";
+  REQUIRE(mkdtemp(root) != NULL);
+  std::string dir = root;
+  write_file(dir + "/hello.html", "hello {$name}");
+  cpptempl::auto_data data;
+  data["name"] = "xu";
+
+  cpptempl::TemplateCache cache(dir, 0);
+  REQUIRE(cache.size() == 0);
+  auto first = cache.get("hello.html");
+  REQUIRE(cache.size() == 1);
+  REQUIRE(cache.render("hello.html", data) == "hello xu");
+  // unchanged file is not compiled again
+  REQUIRE(cache.get("hello.html") == first);
+
+  // timestamps can be coarse, make sure the rewrite gets a new one
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  write_file(dir + "/hello.html", "bye {$name}");
+  auto second = cache.get("hello.html");
+  REQUIRE(second != first);
+  REQUIRE(cache.render("hello.html", data) == "bye xu");
+  // a reader holding the old template can still render it
+  REQUIRE(first->render(data) == "hello xu");
+
+  // without reload the first compile is kept
+  cpptempl::TemplateCache fixed(dir);
+  REQUIRE(fixed.render("hello.html", data) == "bye xu");
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  write_file(dir + "/hello.html", "again {$name}");
+  REQUIRE(fixed.render("hello.html", data) == "bye xu");
+  fixed.clear();
+  REQUIRE(fixed.render("hello.html", data) == "again xu");
+  // segments pointing into a template outlive clear while it's held
+  cpptempl::IovecSink sink;
+  auto held = fixed.render("hello.html", data, &sink);
+  fixed.clear();
+  std::string joined;
+  for (const iovec& v : sink.segments()) {
+    joined.append(static_cast<const char*>(v.iov_base), v.iov_len);
+  }
+  REQUIRE(joined == "again xu");
+
+  REQUIRE_THROWS_AS(cache.get("missing.html"), cpptempl::TemplateException);
+  REQUIRE_THROWS_AS(cache.get("../hello.html"), cpptempl::TemplateException);
+
+  unlink((dir + "/hello.html").c_str());
+  // deleted file: keep serving the last compile
+  REQUIRE(cache.render("hello.html", data) == "bye xu");
+  rmdir(root);
+}
+
+TEST_CASE("cpptempl23", "concurrent render") {
+  const char* text =
+      "{%for r in rows%}{%if r.id > 10 and r.id < 1990%}"
+      "{$r.id}:{$r.name}:{$r.email};{%endif%}{%endfor%}";
+  const cpptempl::auto_data model = build_model();
+  const cpptempl::Template templ(text);
+  const std::string expect = templ.render(model);
+
+  // compiling and rendering from many threads gives the same output
+  std::atomic<int> failures(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; t++) {
+    threads.emplace_back([&]() {
+      for (int n = 0; n < 5; n++) {
+        if (cpptempl::Template(text).render(model) != expect ||
+            templ.render(model) != expect) {
+          failures++;
+        }
+      }
+    });
+  }
+  for (std::thread& t : threads) {
+    t.join();
+  }
+  REQUIRE(failures == 0);
+
+  // the same number of renders split over more threads, on a machine
+  // with enough cores the rate should grow close to linearly
+  const int renders = 256;
+  for (int count = 1; count <= 32; count *= 2) {
+    threads.clear();
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < count; t++) {
+      threads.emplace_back([&]() {
+        std::string out;
+        for (int n = 0; n < renders / count; n++) {
+          out.clear();
+          templ.render_into(model, &out);
+        }
+      });
+    }
+    for (std::thread& t : threads) {
+      t.join();
+    }
+    auto end = std::chrono::steady_clock::now();
+    double sec = std::chrono::duration<double>(end-start).count();
+    printf("%d threads:%.0f renders/s\n", count, renders / sec);
+  }
+  printf("hardware threads:%u\n", std::thread::hardware_concurrency());
+}
+
+TEST_CASE("cpptempl24", "batch render") {
+  const char* text =
+      "Hello {$name}, your order #{$id} has shipped to {$email}.\n";
+  std::vector<cpptempl::auto_data> items(20000);
+  for (size_t i = 0; i < items.size(); i++) {
+    items[i]["id"] = static_cast<int>(i);
+    items[i]["name"] = "recipient";
+    items[i]["email"] = "someone@example.com";
+  }
+  cpptempl::Template templ(text);
+
+  std::string expect;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < items.size(); i++) {
+    expect += cpptempl::parse(text, items[i]);
+  }
+  auto end = std::chrono::steady_clock::now();
+  printf("batch 20k parse loop:%.2fms\n",
+         std::chrono::duration<double, std::milli>(end-start).count());
+
+  cpptempl::ThreadPool pool(4);
+  for (int pass = 0; pass < 2; pass++) {
+    std::string out;
+    cpptempl::StringSink sink(&out);
+    start = std::chrono::steady_clock::now();
+    cpptempl::render_batch(templ, items, [&](size_t) { return &sink; },
+                           pass == 0 ? NULL : &pool);
+    end = std::chrono::steady_clock::now();
+    // output stays in item order
+    REQUIRE(out == expect);
+    printf("batch 20k render_batch %s:%.2fms\n",
+           pass == 0 ? "serial" : "4 threads",
+           std::chrono::duration<double, std::milli>(end-start).count());
+  }
+
+  // one sink per item
+  std::vector<std::string> outs(3);
+  std::vector<cpptempl::StringSink> sinks;
+  for (std::string& s : outs) {
+    sinks.emplace_back(&s);
+  }
+  cpptempl::render_batch(templ, items.data(), 3,
+                         [&](size_t i) { return &sinks[i]; }, &pool);
+  REQUIRE(outs[2] == "Hello recipient, your order #2 has shipped to "
+                     "someone@example.com.\n");
+
+  // exceptions reach the caller and the pool stays usable
+  REQUIRE_THROWS_AS(pool.parallel_for(100, 1, [](size_t i) {
+    if (i == 42) {
+      throw cpptempl::TemplateException("item");
+    }
+  }), cpptempl::TemplateException);
+  std::atomic<size_t> sum(0);
+  pool.parallel_for(1000, 7, [&](size_t i) { sum += i; });
+  REQUIRE(sum == 999 * 1000 / 2);
+}
+
+TEST_CASE("cpptempl25", "parallel loop") {
+  cpptempl::auto_data model;
+  for (int i = 0; i < 100000; i++) {
+    cpptempl::auto_data row;
+    row["id"] = i;
+    row["name"] = "name of the row";
+    row["tags"].push_back("a");
+    row["tags"].push_back("b");
+    model["rows"].push_back(std::move(row));
+  }
+  const char* text =
+      "id,name,tags\n{%for r in rows%}{$r.id},{$r.name},"
+      "{%for t in r.tags%}{$t};{%endfor%}\n{%endfor%}end";
+  cpptempl::Template serial(text);
+
+  cpptempl::ThreadPool pool(4);
+  cpptempl::RenderOptions options;
+  options.pool = &pool;
+  cpptempl::Template parallel(text, options);
+
+  std::string expect;
+  std::string out;
+  for (int pass = 0; pass < 2; pass++) {
+    std::string& str = pass == 0 ? expect : out;
+    auto start = std::chrono::steady_clock::now();
+    (pass == 0 ? serial : parallel).render_into(model, &str);
+    auto end = std::chrono::steady_clock::now();
+    printf("100k row export %s:%.2fms\n", pass == 0 ? "serial" : "parallel",
+           std::chrono::duration<double, std::milli>(end-start).count());
+  }
+  // chunks are joined in order
+  REQUIRE(out == expect);
+
+  // short loops stay serial and give the same output
+  cpptempl::auto_data small;
+  const cpptempl::auto_data& rows = model["rows"];
+  for (int i = 0; i < 3; i++) {
+    small["rows"].push_back(rows[i]);
+  }
+  REQUIRE(parallel.render(small) == serial.render(small));
+}
+
+TEST_CASE("cpptempl26", "iovec render") {
+  std::string text;
+  for (int i = 0; i < 200; i++) {
+    text += "<div class=\"static block of markup that is mostly html\">"
+            "{$title}</div>\n{%for r in rows%}<li>{$r.id} {$r.name}</li>"
+            "{%endfor%}\n";
+  }
+  cpptempl::Template templ(text);
+  cpptempl::auto_data data;
+  data["title"] = "a title longer than the inline size";
+  for (int i = 0; i < 5; i++) {
+    cpptempl::auto_data row = build_row(i);
+    data["rows"].push_back(std::move(row));
+  }
+  std::string expect = templ.render(data);
+
+  cpptempl::IovecSink sink;
+  templ.render(data, &sink);
+  REQUIRE(sink.size() == expect.size());
+  std::string joined;
+  for (const iovec& v : sink.segments()) {
+    joined.append(static_cast<const char*>(v.iov_base), v.iov_len);
+  }
+  REQUIRE(joined == expect);
+
+  // written with writev and read back
+  char path[] = "/tmp/cpptempl_iov_XXXXXX";
+  int fd = mkstemp(path);
+  REQUIRE(fd >= 0);
+  REQUIRE(sink.writev(fd));
+  std::string back(expect.size(), '\0');
+  REQUIRE(pread(fd, &back[0], back.size(), 0) ==
+          static_cast<ssize_t>(back.size()));
+  REQUIRE(back == expect);
+  close(fd);
+  unlink(path);
+
+  // after clear the scratch blocks are reused without allocating
+  sink.clear();
+  templ.render(data, &sink);
+  sink.clear();
+  size_t count = g_alloc_count;
+  templ.render(data, &sink);
+  size_t allocs = g_alloc_count - count;
+  REQUIRE(allocs == 0);
+
+  std::string out;
+  for (int pass = 0; pass < 2; pass++) {
+    auto start = std::chrono::steady_clock::now();
+    for (int n = 0; n < 1000; n++) {
+      if (pass == 0) {
+        out.clear();
+        templ.render_into(data, &out);
+      } else {
+        sink.clear();
+        templ.render(data, &sink);
+      }
+    }
+    auto end = std::chrono::steady_clock::now();
+    printf("%s x1000:%.2fms\n", pass == 0 ? "string" : "iovec",
+           std::chrono::duration<double, std::milli>(end-start).count());
+  }
+
+  // parse doesn't keep the caller's text, which is gone here
+  sink.clear();
+  cpptempl::parse(std::string("<h1 class=\"static heading markup\">{$title}"
+                              "</h1>\n"), data, &sink);
+  std::string parsed;
+  for (const iovec& v : sink.segments()) {
+    parsed.append(static_cast<const char*>(v.iov_base), v.iov_len);
+  }
+  REQUIRE(parsed == "<h1 class=\"static heading markup\">"
+                    "a title longer than the inline size</h1>\n");
+}
+
+TEST_CASE("cpptempl27", "ahead of time compiled template") {
+  std::string text;
+  FILE* f = fopen("templates/notify.tmpl", "rb");
+  REQUIRE(f != NULL);
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    text.append(buf, n);
+  }
+  fclose(f);
+  cpptempl::Template templ(text);
+
+  cpptempl::auto_data data;
+  data["name"] = "xu";
+  data["title"] = "weekly \"digest\"";
+  // no items: the generated code takes the same branches
+  data["count"] = 0;
+  REQUIRE(templates::render_notify(data) == templ.render(data));
+
+  data["count"] = 1000;
+  for (int i = 0; i < 1000; i++) {
+    cpptempl::auto_data item = build_row(i);
+    if (i % 3 == 0) {
+      item["tags"].push_back("new");
+      item["tags"].push_back("sale");
+    }
+    data["items"].push_back(std::move(item));
+  }
+  std::string expect = templ.render(data);
+  REQUIRE(templates::render_notify(data) == expect);
+  REQUIRE(expect.find("[new sale ]") != std::string::npos);
+  REQUIRE(expect.find("busy eq") != std::string::npos);
+
+  std::string out;
+  for (int pass = 0; pass < 2; pass++) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 100; i++) {
+      out.clear();
+      cpptempl::StringSink sink(&out);
+      if (pass == 0) {
+        templ.render(data, &sink);
+      } else {
+        templates::render_notify(data, &sink);
+      }
+    }
+    auto end = std::chrono::steady_clock::now();
+    printf("%s x100:%.2fms\n", pass == 0 ? "Template" : "cpptemplc",
+           std::chrono::duration<double, std::milli>(end-start).count());
+  }
+}
+
+#ifdef CPPTEMPL_CT_TEMPLATE
+TEST_CASE("cpptempl28", "compile-time template") {
+  cpptempl::auto_data data;
+  data["age"] = 10;
+  data["name"] = "xu";
+  data["user"]["email"] = "someone@example.com";
+  using Templ = cpptempl::ct_template<"name:{$name}, age:{$age}">;
+  REQUIRE(Templ::render(data) == "name:xu, age:10");
+  static_assert(Templ::static_size() == 11);
+
+  // the same output as the runtime parser, including stray braces
+  // and literals
+  constexpr const char text[] =
+      "{$user.email} {$user.none} {$missing} {x} {$\"lit\"} {$open {";
+  REQUIRE(cpptempl::ct_template<text>::render(data) ==
+          cpptempl::parse(text, data));
+
+  cpptempl::Template templ("name:{$name}, age:{$age}");
+  for (int pass = 0; pass < 2; pass++) {
+    std::string out;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 1000000; i++) {
+      out.clear();
+      cpptempl::StringSink sink(&out);
+      if (pass == 0) {
+        templ.render(data, &sink);
+      } else {
+        Templ::render(data, &sink);
+      }
+    }
+    auto end = std::chrono::steady_clock::now();
+    printf("%s x1M:%.2fms\n", pass == 0 ? "Template" : "ct_template",
+           std::chrono::duration<double, std::milli>(end-start).count());
+  }
+}
+#endif
+
+struct Address {
+  std::string city;
+  const char* zip;
+};
+
+struct Person {
+  std::string name;
+  int age;
+  double score;
+  bool admin;
+  Address address;
+  std::vector<std::string> tags;
+  std::vector<Person> friends;
+  cpptempl::auto_data extra;
+};
+
+template <>
+struct cpptempl::type_fields<Address> {
+  static std::vector<cpptempl::FieldInfo> get() {
+    return {cpptempl::field("city", &Address::city),
+            cpptempl::field("zip", &Address::zip)};
+  }
+};
+
+template <>
+struct cpptempl::type_fields<Person> {
+  static std::vector<cpptempl::FieldInfo> get() {
+    return {cpptempl::field("name", &Person::name),
+            cpptempl::field("age", &Person::age),
+            cpptempl::field("score", &Person::score),
+            cpptempl::field("admin", &Person::admin),
+            cpptempl::field("address", &Person::address),
+            cpptempl::field("tags", &Person::tags),
+            cpptempl::field("friends", &Person::friends),
+            cpptempl::field("extra", &Person::extra)};
+  }
+};
+
+static cpptempl::auto_data person_to_data(const Person& p) {
+  cpptempl::auto_data d;
+  d["name"] = p.name;
+  d["age"] = p.age;
+  d["score"] = p.score;
+  d["admin"] = p.admin;
+  d["address"]["city"] = p.address.city;
+  if (p.address.zip != NULL) {
+    d["address"]["zip"] = p.address.zip;
+  }
+  for (const std::string& t : p.tags) {
+    d["tags"].push_back(t);
+  }
+  for (const Person& f : p.friends) {
+    d["friends"].push_back(person_to_data(f));
+  }
+  d["extra"] = p.extra;
+  return d;
+}
+
+TEST_CASE("cpptempl29", "struct binding") {
+  Person person{"xu", 30, 2.5, true, {"Shenzhen", "518000"}, {"a", "b"},
+                {}, cpptempl::auto_data()};
+  person.extra["note"] = "from auto_data";
+  person.friends.push_back(Person{"li", 20, 1.0, false, {"Beijing", NULL},
+                                  {}, {}, cpptempl::auto_data()});
+  person.friends.push_back(Person{"wang", 40, 0.5, false,
+                                  {"Shanghai", "200000"}, {"c"}, {},
+                                  cpptempl::auto_data()});
+
+  const char* text =
+      "{$p.name} {$p.age} {$p.score} {$p.address.city} {$p.address.zip} "
+      "{$p.extra.note} {$p.missing}|"
+      "{%for t in p.tags%}{$t},{%endfor%}|"
+      "{%for f in p.friends%}{$f.name}@{$f.address.city}"
+      "{%if f.age > p.age%}+{%endif%}{%if f.address.zip%}z{%endif%}"
+      "{%if f.name == \"li\"%}!{%endif%}"
+      "{%for t in f.tags%}#{$t}{%endfor%};{%endfor%}"
+      "{%if p.admin and p.friends%}admin{%endif%}";
+  cpptempl::Template templ(text);
+  cpptempl::auto_data data;
+  data["p"] = person_to_data(person);
+  std::string expect = templ.render(data);
+  REQUIRE(expect == "xu 30 2.5 Shenzhen 518000 from auto_data |a,b,|"
+                    "li@Beijing!;wang@Shanghai+z#c;admin");
+  REQUIRE(templ.render("p", person) == expect);
+  // the tree walk gives the same
+  std::string walked;
+  cpptempl::StringSink sink(&walked);
+  cpptempl::auto_data null_data;
+  cpptempl::Context root(null_data);
+  cpptempl::Context scope(&root, "p", cpptempl::value_ref::of(person));
+  for (cpptempl::Token* token : templ.tree()) {
+    token->render(scope, &sink);
+  }
+  REQUIRE(walked == expect);
+
+  // a vector of structs
+  cpptempl::Template list("{%for f in people%}{$f.name} {%endfor%}");
+  REQUIRE(list.render("people", person.friends) == "li wang ");
+
+  // converting to auto_data for every render against binding in place
+  std::vector<Person> people(1000, person);
+  cpptempl::Template page("{%for p in people%}{$p.name},{$p.age},"
+                          "{$p.address.city};{%endfor%}");
+  std::string out;
+  for (int pass = 0; pass < 2; pass++) {
+    auto start = std::chrono::steady_clock::now();
+    for (int n = 0; n < 20; n++) {
+      out.clear();
+      cpptempl::StringSink sink(&out);
+      if (pass == 0) {
+        cpptempl::auto_data model;
+        for (const Person& p : people) {
+          model["people"].push_back(person_to_data(p));
+        }
+        page.render(model, &sink);
+      } else {
+        page.render("people", people, &sink);
+      }
+    }
+    auto end = std::chrono::steady_clock::now();
+    printf("%s x20:%.2fms\n", pass == 0 ? "to auto_data" : "struct binding",
+           std::chrono::duration<double, std::milli>(end-start).count());
+  }
+}
+
+TEST_CASE("cpptempl30", "lazy values") {
+  int counts = 0;
+  int dates = 0;
+  cpptempl::auto_data data;
+  data["show"] = false;
+  data["count"] = cpptempl::auto_data::lazy([&]() {
+    counts++;
+    return cpptempl::auto_data(42);
+  });
+  data["date"] = cpptempl::auto_data::lazy([&]() {
+    dates++;
+    return cpptempl::auto_data("2016-01-01");
+  });
+
+  // behind a false branch the provider is never called
+  cpptempl::Template templ(
+      "{%if show%}{$count}{%endif%} {$date} {$date}"
+      "{%if count > 40%} many{%endif%}");
+  REQUIRE(templ.render(data) == " 2016-01-01 2016-01-01 many");
+  REQUIRE(counts == 1);
+  REQUIRE(dates == 1);
+  // once per render
+  data["show"] = true;
+  REQUIRE(templ.render(data) == "42 2016-01-01 2016-01-01 many");
+  REQUIRE(counts == 2);
+  REQUIRE(dates == 2);
+  REQUIRE(cpptempl::parse("{$count}{$count}", data) == "4242");
+  REQUIRE(counts == 3);
+  REQUIRE(cpptempl::parse_val("count", data).str() == "");
+  REQUIRE(static_cast<int>(cpptempl::parse_val("count", data)) == 42);
+
+  // a lazy list, and copies keep the provider
+  cpptempl::auto_data copy = data;
+  copy["rows"] = cpptempl::auto_data::lazy([]() {
+    cpptempl::auto_data rows;
+    for (int i = 0; i < 5000; i++) {
+      rows.push_back(i);
+    }
+    return rows;
+  });
+  dates = 0;
+  cpptempl::ThreadPool pool(4);
+  cpptempl::RenderOptions options;
+  options.pool = &pool;
+  options.parallel_min_items = 100;
+  cpptempl::Template rows("{%for r in rows%}{%if r == 4999%}{$r} {$date}"
+                          "{%endif%}{%endfor%}", options);
+  REQUIRE(rows.render(copy) == "4999 2016-01-01");
+  // the parallel chunks shared one result
+  cpptempl::Template all("{%for r in rows%}{$date}{%endfor%}", options);
+  REQUIRE(all.render(copy).size() == 5000 * 10);
+  REQUIRE(dates == 2);
+
+  // a lazy value per row, serial and in parallel chunks
+  std::atomic<int> calls{0};
+  cpptempl::auto_data table;
+  for (int i = 0; i < 40000; i++) {
+    cpptempl::auto_data row;
+    row["date"] = cpptempl::auto_data::lazy([&calls, i]() {
+      calls++;
+      return cpptempl::auto_data(i % 10);
+    });
+    table["rows"].push_back(std::move(row));
+  }
+  std::string expected;
+  for (int i = 0; i < 40000; i++) {
+    expected += std::to_string(i % 10) + ";";
+  }
+  const char* text = "{%for r in rows%}{$r.date};{%endfor%}";
+  REQUIRE(cpptempl::Template(text).render(table) == expected);
+  REQUIRE(calls == 40000);
+  REQUIRE(cpptempl::Template(text, options).render(table) == expected);
+  REQUIRE(calls == 80000);
+
+  // lazy lists and maps through cpptemplc output and ct_template
+  int maps = 0;
+  cpptempl::auto_data lazies;
+  lazies["rows"] = cpptempl::auto_data::lazy([]() {
+    cpptempl::auto_data rows;
+    rows.push_back(1);
+    rows.push_back(2);
+    return rows;
+  });
+  lazies["m"] = cpptempl::auto_data::lazy([&maps]() {
+    maps++;
+    cpptempl::auto_data m;
+    m["k"] = "v";
+    cpptempl::auto_data item;
+    item["v"] = cpptempl::auto_data::lazy([]() {
+      return cpptempl::auto_data("x");
+    });
+    m["list"].push_back(std::move(item));
+    return m;
+  });
+  lazies["n"] = cpptempl::auto_data::lazy([]() {
+    return cpptempl::auto_data("big");
+  });
+  std::string lazy_expect = "1;2;|v|big|x\n";
+  FILE* f = fopen("templates/lazy.tmpl", "rb");
+  REQUIRE(f != NULL);
+  char buf[256];
+  std::string lazy_text(buf, fread(buf, 1, sizeof(buf), f));
+  fclose(f);
+  REQUIRE(cpptempl::Template(lazy_text).render(lazies) == lazy_expect);
+  REQUIRE(maps == 1);
+  REQUIRE(templates::render_lazy(lazies) == lazy_expect);
+  REQUIRE(maps == 2);
+#ifdef CPPTEMPL_CT_TEMPLATE
+  REQUIRE(cpptempl::ct_template<"{$m.k}|{$n}|{$m.k}">::render(lazies) ==
+          "v|big|v");
+  REQUIRE(maps == 3);
+#endif
+}
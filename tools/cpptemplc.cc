@@ -0,0 +1,357 @@
+// Copyright (C) 2015 sails Authors.
+// All rights reserved.
+//
+// Official git repository and contact information can be found at
+// https://github.com/sails/cpptempl and http://www.sailsxu.com/.
+//
+// Filename: cpptemplc.cc
+// Description: compiles a template into a C++ header with a render
+//              function, so templates shipped with a binary are never
+//              parsed at runtime
+//
+// usage: cpptemplc [-n name] [-s namespace] input output.h
+// generates, in namespace (default "templates"):
+//   void render_<name>(const cpptempl::auto_data& data,
+//                      cpptempl::OutputSink* out,
+//                      const cpptempl::RenderOptions& options = {});
+//   std::string render_<name>(const cpptempl::auto_data& data);
+// name defaults to the input file name up to the first '.'.
+// Static text becomes string literals written with write_static, loop
+// variables become C++ references so variables are resolved while
+// generating, and if conditions become C++ expressions, so nothing is
+// parsed at runtime. Lazy values are computed through the root Context,
+// once per render.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "../src/cpptempl.h"
+
+namespace {
+
+// a loop variable in scope while generating
+struct Scope {
+  std::string name;
+  std::string var;  // C++ reference bound to the current element
+};
+
+class Generator {
+ public:
+  explicit Generator(std::string* out) : m_out(out) {}
+
+  void body(const cpptempl::TokenList& tokens, int indent) {
+    for (cpptempl::Token* token : tokens) {
+      switch (token->gettype()) {
+        case cpptempl::TOKEN_TYPE_TEXT:
+          text(static_cast<cpptempl::TokenText*>(token)->text(), indent);
+          break;
+        case cpptempl::TOKEN_TYPE_VAR:
+          var(static_cast<cpptempl::TokenVar*>(token)->path(), indent);
+          break;
+        case cpptempl::TOKEN_TYPE_FOR:
+          loop(static_cast<cpptempl::TokenFor*>(token), indent);
+          break;
+        case cpptempl::TOKEN_TYPE_IF:
+          cond(static_cast<cpptempl::TokenIf*>(token), indent);
+          break;
+        default:
+          break;
+      }
+    }
+  }
+
+ private:
+  static std::string quote(std::string_view text) {
+    std::string str = "\"";
+    for (char c : text) {
+      switch (c) {
+        case '\"': str += "\\\""; break;
+        case '\\': str += "\\\\"; break;
+        case '\n': str += "\\n"; break;
+        case '\r': str += "\\r"; break;
+        case '\t': str += "\\t"; break;
+        case '?': str += "\\?"; break;  // no trigraphs
+        default:
+          if (static_cast<unsigned char>(c) < 0x20) {
+            char temp[8];
+            snprintf(temp, sizeof(temp), "\\%03o", c);
+            str += temp;
+          } else {
+            str += c;
+          }
+      }
+    }
+    return str + "\"";
+  }
+
+  void line(int indent, const std::string& code) {
+    m_out->append(indent * 2, ' ');
+    *m_out += code;
+    *m_out += '\n';
+  }
+
+  // C++ expression for a temporary holding a literal
+  static std::string literal(const cpptempl::auto_data& value) {
+    switch (value.Type()) {
+      case cpptempl::auto_data::data_type::number_integer: {
+        int64_t number = value;
+        if (number == INT64_MIN) {
+          return "cpptempl::auto_data(INT64_MIN)";
+        }
+        return "cpptempl::auto_data(static_cast<int64_t>(" +
+               std::to_string(number) + "LL))";
+      }
+      case cpptempl::auto_data::data_type::number_float: {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%.17g", static_cast<double>(value));
+        std::string number = buf;
+        if (number.find_first_of(".e") == std::string::npos) {
+          number += ".0";
+        }
+        return "cpptempl::auto_data(" + number + ")";
+      }
+      default:
+        return "cpptempl::auto_data(" + quote(value.str()) + ")";
+    }
+  }
+
+  // C++ expression for a reference to the value of path, or for a
+  // literal path a temporary
+  std::string value(const cpptempl::VarPath& path) const {
+    if (path.is_literal()) {
+      return literal(path.literal());
+    }
+    std::string expr = pointer(path);
+    return expr[0] == '&' ? expr.substr(1) : "*" + expr;
+  }
+
+  std::string pointer(const cpptempl::VarPath& path) const {
+    const std::vector<std::string>& segments = path.segments();
+    std::string expr = "cpptempl::lookup(ctx, &data, " + quote(segments[0]) + ")";
+    for (size_t i = m_scopes.size(); i > 0; --i) {
+      if (m_scopes[i-1].name == segments[0]) {
+        expr = "&" + m_scopes[i-1].var;
+        break;
+      }
+    }
+    for (size_t i = 1; i < segments.size(); ++i) {
+      expr = "cpptempl::lookup(ctx, " + expr + ", " + quote(segments[i]) + ")";
+    }
+    return expr;
+  }
+
+  void text(std::string_view text, int indent) {
+    // one literal per template line keeps the output readable
+    std::string literal;
+    size_t pos = 0;
+    while (pos < text.size()) {
+      size_t end = text.find('\n', pos);
+      end = end == std::string_view::npos ? text.size() : end + 1;
+      if (!literal.empty()) {
+        literal += "\n";
+        literal.append(indent * 2 + 4, ' ');
+      }
+      literal += quote(text.substr(pos, end - pos));
+      pos = end;
+    }
+    line(indent, "out->write_static(" + literal + ", " +
+         std::to_string(text.size()) + ");");
+  }
+
+  void var(const cpptempl::VarPath& path, int indent) {
+    if (path.is_literal()) {
+      std::string_view str = path.literal().str();
+      line(indent, "out->write(" + quote(str) + ", " +
+           std::to_string(str.size()) + ");");
+      return;
+    }
+    line(indent,
+         "cpptempl::write_value(" + value(path) + ", out, options);");
+  }
+
+  void loop(const cpptempl::TokenFor* token, int indent) {
+    std::string id = std::to_string(++m_count);
+    std::string list = "list" + id;
+    std::string index = "i" + id;
+    std::string size = "n" + id;
+    Scope scope{token->m_val, "v" + id};
+    line(indent, "{");
+    line(indent + 1, "const cpptempl::auto_data& " + list + " = " +
+         value(token->list()) + ";");
+    line(indent + 1, "for (int " + index + " = 0, " + size + " = " + list +
+         ".size(); " + index + " < " + size + "; ++" + index + ") {");
+    line(indent + 2, "const cpptempl::auto_data& " + scope.var +
+         " = ctx.resolve(" + list + "[" + index + "]);");
+    m_scopes.push_back(scope);
+    body(token->get_children(), indent + 2);
+    m_scopes.pop_back();
+    line(indent + 1, "}");
+    line(indent, "}");
+  }
+
+  void cond(const cpptempl::TokenIf* token, int indent) {
+    const cpptempl::Expression& expr = token->condition();
+    std::string test = expr.nodes().empty() ?
+        "false" : condition(expr, expr.root());
+    line(indent, "if (" + test + ") {");
+    body(token->get_children(), indent + 1);
+    line(indent, "}");
+  }
+
+  // C++ bool expression for node index of expr, evaluated like
+  // Expression::is_true
+  std::string condition(const cpptempl::Expression& expr,
+                        size_t index) const {
+    typedef cpptempl::Expression E;
+    const E::Node& node = expr.nodes()[index];
+    switch (node.op) {
+      case E::OP_VALUE:
+        return "(" + value(node.path) + ").is_true()";
+      case E::OP_NOT:
+        return "!" + condition(expr, node.lhs);
+      case E::OP_AND:
+        return "(" + condition(expr, node.lhs) + " && " +
+               condition(expr, node.rhs) + ")";
+      case E::OP_OR:
+        return "(" + condition(expr, node.lhs) + " || " +
+               condition(expr, node.rhs) + ")";
+      default: {
+        static const char* const kOps[] = {
+          "", "", "", "", "OP_EQ", "OP_NE", "OP_LT", "OP_LE", "OP_GT", "OP_GE",
+        };
+        return "cpptempl::Expression::compare(cpptempl::Expression::" +
+               std::string(kOps[node.op]) + ", " + operand(expr, node.lhs) +
+               ", " + operand(expr, node.rhs) + ")";
+      }
+    }
+  }
+
+  // operand of a comparison, a nested condition compares as a boolean
+  std::string operand(const cpptempl::Expression& expr, size_t index) const {
+    const cpptempl::Expression::Node& node = expr.nodes()[index];
+    if (node.op == cpptempl::Expression::OP_VALUE) {
+      return value(node.path);
+    }
+    return "cpptempl::auto_data(" + condition(expr, index) + ")";
+  }
+
+  std::string* m_out;
+  std::vector<Scope> m_scopes;
+  int m_count = 0;
+};
+
+bool read_file(const char* file, std::string* text) {
+  FILE* f = fopen(file, "rb");
+  if (f == NULL) {
+    return false;
+  }
+  char buf[8192];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    text->append(buf, n);
+  }
+  fclose(f);
+  return true;
+}
+
+// file name without directory, up to the first '.', as an identifier
+std::string default_name(std::string_view path) {
+  size_t slash = path.find_last_of('/');
+  if (slash != std::string_view::npos) {
+    path = path.substr(slash + 1);
+  }
+  path = path.substr(0, path.find('.'));
+  std::string name;
+  for (char c : path) {
+    bool ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+              (c >= '0' && c <= '9') || c == '_';
+    name += ok ? c : '_';
+  }
+  return name;
+}
+
+int usage() {
+  fprintf(stderr, "usage: cpptemplc [-n name] [-s namespace] input output\n");
+  return 2;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  std::string name;
+  std::string ns = "templates";
+  std::vector<const char*> files;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if ((arg == "-n" || arg == "-s") && i + 1 < argc) {
+      (arg == "-n" ? name : ns) = argv[++i];
+    } else if (!arg.empty() && arg[0] == '-') {
+      return usage();
+    } else {
+      files.push_back(argv[i]);
+    }
+  }
+  if (files.size() != 2) {
+    return usage();
+  }
+  if (name.empty()) {
+    name = default_name(files[0]);
+  }
+
+  std::string text;
+  if (!read_file(files[0], &text)) {
+    fprintf(stderr, "cpptemplc: can not read %s\n", files[0]);
+    return 1;
+  }
+  std::string code;
+  try {
+    cpptempl::Template templ(text);
+    Generator generator(&code);
+    generator.body(templ.tree(), 1);
+  } catch (const cpptempl::TemplateException& e) {
+    fprintf(stderr, "%s: %s\n", files[0], e.what());
+    return 1;
+  }
+
+  std::string guard = "CPPTEMPLC_" + ns + "_" + name + "_H_";
+  for (char& c : guard) {
+    c = (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : (c == ':' ? '_' : c);
+  }
+  std::string header =
+      "// generated by cpptemplc from " + std::string(files[0]) +
+      ", do not edit\n\n"
+      "#ifndef " + guard + "\n"
+      "#define " + guard + "\n\n"
+      "#include <string>\n"
+      "#include \"cpptempl.h\"\n\n"
+      "namespace " + ns + " {\n\n"
+      "inline void render_" + name + "(\n"
+      "    const cpptempl::auto_data& data, cpptempl::OutputSink* out,\n"
+      "    const cpptempl::RenderOptions& options = "
+      "cpptempl::RenderOptions()) {\n"
+      "  cpptempl::Context ctx(data, &options);\n" +
+      code +
+      "}\n\n"
+      "inline std::string render_" + name +
+      "(const cpptempl::auto_data& data) {\n"
+      "  std::string str;\n"
+      "  cpptempl::StringSink out(&str);\n"
+      "  render_" + name + "(data, &out);\n"
+      "  return str;\n"
+      "}\n\n"
+      "}  // namespace " + ns + "\n\n"
+      "#endif  // " + guard + "\n";
+
+  FILE* f = fopen(files[1], "wb");
+  if (f == NULL ||
+      fwrite(header.data(), 1, header.size(), f) != header.size()) {
+    fprintf(stderr, "cpptemplc: can not write %s\n", files[1]);
+    if (f != NULL) {
+      fclose(f);
+    }
+    return 1;
+  }
+  fclose(f);
+  return 0;
+}